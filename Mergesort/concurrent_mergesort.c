@@ -1,7 +1,9 @@
-# define _POSIX_C_SOURCE 199309L //required for clock
+# define _GNU_SOURCE //required for clock and getopt_long
 # include <sys/types.h>
 # include <sys/ipc.h>
 # include <sys/shm.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
 # include <stdio.h>
 # include <stdlib.h>
 # include <unistd.h>
@@ -9,6 +11,49 @@
 # include <fcntl.h>
 # include <time.h>
 # include <pthread.h>
+# include <sched.h>
+# include <stdatomic.h>
+# include <getopt.h>
+# include <limits.h>
+# include <string.h>
+# include <ctype.h>
+# include <stdint.h>
+# include <dirent.h>
+# ifdef HAVE_LIBNUMA
+# include <numa.h>
+# endif
+# ifndef NO_PERF_COUNTERS
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+# endif
+# include "concurrent_mergesort.h"
+# define SEQUENTIAL_CUTOFF 8192 // segments of at most this many elements are sorted by a single worker
+# define MIN_FORK_SEGMENT 65536 // default minimum segment size for which a child process is forked
+# define PARALLEL_MERGE_THRESHOLD 65536 // segments larger than this are merged by several workers
+# define SMALL_SORT_SIZE 8 // number of elements sorted by one sorting network
+# define DEFAULT_LEAF_CUTOFF 32 // default maximum size of a segment sorted without further splitting
+# define MAX_LEAF_CUTOFF 1024
+# define DEFAULT_RADIX_BITS 8 // bits sorted per radix sort pass
+# define MERGE_WAYS 8 // runs combined by every merge of the bottom-up mergesort (at most MAX_MERGE_WAYS)
+# define MAX_MERGE_WAYS 8
+# define MERGE_SLICE 16384 // output elements of a multiway merge produced at a time through cache-resident scratch space
+# define SAMPLE_BUCKETS_PER_WORKER 4 // splitters of the sample sort per worker (more buckets than workers for balance)
+# define SAMPLE_OVERSAMPLING 32 // elements sampled per sample sort splitter
+# define SELECT_SAMPLE_SIZE 127 // elements sampled to choose the pivot of a parallel selection round
+# define MAX_SELECT_ROUNDS 64 // parallel selection rounds before the rest is left to the sequential selection
+# define MIN_GALLOP 7 // consecutive elements taken from one run before the adaptive merge switches to galloping
+# define RADIX_LINE 16 // elements staged per digit before the radix sort scatter writes them out (one cache line)
+# define HUGE_PAGE_SIZE (2 << 20) // shared segments backed by huge pages are rounded up to a multiple of this
+# define IO_BUFFER_SIZE (1 << 20) // bytes moved per read/write call by the buffered text input and output
+# define STREAM_CHUNK (1 << 18) // integers parsed before --stream hands them to the thread pool to be sorted
+# define DEFAULT_EXTERNAL_MEMORY 256 // default memory budget of the external mergesort (MB)
+# define MIN_EXTERNAL_BLOCK 4096 // smallest block read from a run during the external merge (bytes)
+# ifndef RECORD_PAYLOAD_SIZE
+# define RECORD_PAYLOAD_SIZE 8 // bytes carried along with every 64-bit key by --type record
+# endif
+# define NUM_PERF_EVENTS 7 // cycles, instructions, cache misses, branch misses, context switches, page faults, dTLB misses
+# define PERF_DTLB_EVENT 6
+# define NUM_PERF_PHASES 2 // sorting the two halves, merging them
 # define GREEN "\033[0;32m"
 # define RED "\033[0;31m"
 # define RESET "\033[m"
@@ -19,238 +64,3310 @@ typedef struct arrayInfo {
     int lb;
     int ub;
     int* arr;
+    int* buf; // scratch space of the same size as arr
+    int to_buf; // whether the sorted segment should end up in buf instead of arr
 } arrayInfo;
 
+typedef struct mergeInfo {
+    const int* src;
+    int* dst;
+    int lb;
+    int mid;
+    int ub;
+    int out_lb; // first position of dst[lb..ub] produced by this merge
+    int out_ub; // last position of dst[lb..ub] produced by this merge
+} mergeInfo;
+
+typedef struct task {
+    void* (*function)(void*);
+    void* arg;
+    atomic_int done;
+    int notify; // set for root tasks awaited by a thread outside the pool
+    int owner; // worker that must run the task (-1 for any worker)
+} task;
+
+typedef struct taskDeque {
+    task** tasks;
+    int top; // thieves steal from the top
+    int bottom; // owner pushes and pops at the bottom
+    int capacity;
+    pthread_mutex_t mutex;
+} taskDeque;
+
+# ifndef NO_PERF_COUNTERS
+typedef struct perfCounters {
+    int fds[NUM_PERF_EVENTS]; // -1 for events the kernel or CPU does not support
+} perfCounters;
+
+typedef struct perfReport {
+    int n; // size of the measured sort, its final merge starts the merge phase
+    int phase;
+    long long start[NUM_PERF_EVENTS]; // counts at the start of the current phase
+    long long values[NUM_PERF_PHASES][NUM_PERF_EVENTS];
+} perfReport;
+# else
+typedef struct perfReport {
+    char unused;
+} perfReport;
+# endif
+
+typedef struct threadPool {
+    int num_workers;
+    int num_deques;
+    pthread_t* workers;
+    taskDeque* deques; // one deque per worker, plus one (the last) for tasks submitted from outside the pool
+    atomic_int idle_workers;
+    atomic_int shutdown;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t work_available; // signal from submitter to idle workers
+    pthread_cond_t task_done; // signal from worker to external thread waiting in poolRun
+# ifndef NO_PERF_COUNTERS
+    perfCounters* counters; // counters of each worker thread, opened by the worker itself
+    atomic_int started; // number of workers that have opened their counters
+# endif
+} threadPool;
+
+typedef struct rangeTask {
+    int lo;
+    int hi;
+    void (*body)(void* ctx, int i);
+    void* ctx;
+} rangeTask;
+
+typedef struct radixInfo {
+    int* src;
+    int* dst;
+    int n;
+    int num_chunks;
+    int num_digits;
+    int shift; // position of the digit sorted by the current pass
+    int* counts; // num_chunks x num_digits digit counts, then output offsets
+} radixInfo;
+
+typedef struct bottomUpInfo {
+    int* arr;
+    int* buf;
+    const int* src; // runs of the current pass
+    int* dst;
+    int n;
+    int block; // elements sorted by one worker before the first pass
+    int to_buf; // whether the blocks are sorted into buf
+    long long width; // length of the runs of the current pass
+    int num_parts; // the output of every pass is split evenly into one part per worker
+} bottomUpInfo;
+
+typedef struct sampleInfo {
+    int* src;
+    int* dst;
+    int n;
+    int num_chunks;
+    int num_splitters; // 2^levels - 1
+    int levels;
+    int* splitters; // sorted, bucket 2i holds elements between splitters i-1 and i, bucket 2i+1 those equal to splitter i
+    int* tree; // the splitters as an implicit binary search tree, tree[1] is the root and tree[2j], tree[2j+1] its children
+    int num_buckets; // 2 * num_splitters + 1
+    int* counts; // num_chunks x num_buckets bucket counts, then output offsets
+    int* bucket_starts; // first position of every bucket in dst, followed by n
+} sampleInfo;
+
+typedef struct selectInfo {
+    int* arr;
+    int* buf;
+    int lo; // the k-th element lies in arr[lo..hi-1]
+    int hi;
+    int num_chunks;
+    int pivot;
+    int* counts; // num_chunks x 3 counts of elements smaller than, equal to and larger than pivot, then offsets
+} selectInfo;
+
+typedef struct batchInfo {
+    sortSegment* segments;
+    int* item_starts; // work item i sorts segments item_starts[i]..item_starts[i+1]-1
+} batchInfo;
+
+typedef struct numaInfo {
+    int* arr;
+    int* buf;
+    const int* src; // sorted runs merged by the current level
+    int* dst;
+    int n;
+    int num_parts; // one partition per worker, sorted and first-touched by that worker
+    int width; // partitions per sorted run at the current merge level
+    int to_buf; // whether the partitions are sorted into buf
+} numaInfo;
+
+typedef struct runInfo {
+    int* arr;
+    int* buf; // scratch space of the same size as arr
+    int n;
+    int num_chunks;
+    int max_runs; // maximum number of runs found in one chunk
+    int* chunk_runs; // chunk c stores the starts of its runs from chunk_runs[c * max_runs]
+    int* num_chunk_runs;
+    int* runs; // start of every run of the whole array, followed by n
+    int lo; // first run merged by this task
+    int hi; // one past the last run merged by this task
+} runInfo;
+
+typedef struct inputBuffer {
+    int fd;
+    char* data;
+    size_t pos; // next unread byte
+    size_t len; // number of valid bytes in data
+    int eof;
+} inputBuffer;
+
+typedef struct outputBuffer {
+    int fd;
+    char* data;
+    size_t len;
+} outputBuffer;
+
+typedef struct record {
+    uint64_t key;
+    char payload[RECORD_PAYLOAD_SIZE];
+} record;
+
+typedef struct elementType {
+    const char* name;
+    int size; // bytes per element
+    int key_size; // bytes at the start of an element that are byte swapped on big-endian hosts
+    void (*sort)(void* data, int n);
+} elementType;
+
+typedef struct ioRequest {
+    int fd;
+    int is_write;
+    void* data;
+    size_t size;
+    off_t offset;
+    size_t result; // number of bytes transferred
+    int done;
+    struct ioRequest* next;
+} ioRequest;
+
+typedef struct ioQueue {
+    ioRequest* head;
+    ioRequest* tail;
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted; // signal from sort to I/O thread
+    pthread_cond_t completed; // signal from I/O thread to sort
+    pthread_t thread;
+} ioQueue;
+
+typedef struct runReader {
+    int fd;
+    off_t next_offset; // offset of the next block to prefetch
+    off_t end; // end of the run in the file
+    size_t buf_size;
+    int* bufs[2]; // block being consumed and block being prefetched
+    int cur;
+    int pos;
+    int len;
+    ioRequest req;
+} runReader;
+
+typedef struct streamChunk {
+    arrayInfo ai; // the chunk is arr[ai.lb..ai.ub]
+    task t;
+} streamChunk;
+
+
+// ------------------- GLOBAL VARIABLES -------------------
+int shm_id;
+int buf_shm_id; // shared scratch space for the multi-process mergesort
+threadPool* sort_pool; // pool used by multi-threaded mergesort
+__thread int worker_id = -1; // index of the pool worker running on this thread (-1 outside the pool)
+int max_fork_depth = -1; // depth of the fork tree (-1 means log2 of the number of online cores)
+int min_fork_segment = MIN_FORK_SEGMENT; // segments smaller than this are never split across processes
+int radix_bits = DEFAULT_RADIX_BITS;
+int perf_enabled = 0; // --perf
+int huge_pages = 0; // --huge-pages
+int top_k = 0; // --top-k
+const char* share_backing = "4K pages"; // pages backing the last segment created by shareMem
+int numa_mode = 0; // --numa
+int* worker_cpus = NULL; // CPUs ordered node by node, worker w is pinned to worker_cpus[w % num_worker_cpus]
+int* worker_nodes = NULL; // NUMA node of each entry of worker_cpus
+int num_worker_cpus = 0;
+int num_numa_nodes = 1;
+# ifndef NO_PERF_COUNTERS
+perfCounters perf_main; // main thread and, through inheritance, every process it forks
+perfReport* perf_report = NULL; // sort being measured
+# endif
+
+
+// ------------------- BUFFERED TEXT INPUT AND OUTPUT -------------------
+// integers are parsed from and formatted into large buffers moved with one read(2) / write(2) per chunk,
+// instead of one scanf / printf call per element
+void refillInput(inputBuffer* in)
+{
+    // keep the unread tail (possibly a partial number) and fill the rest of the buffer
+    size_t tail = in->len - in->pos;
+    memmove(in->data, in->data + in->pos, tail);
+    in->len = tail;
+    in->pos = 0;
+    while(in->len < IO_BUFFER_SIZE && in->eof == 0)
+    {
+        ssize_t r = read(in->fd, in->data + in->len, IO_BUFFER_SIZE - in->len);
+        if(r <= 0)
+            in->eof = 1;
+        else
+            in->len += r;
+    }
+}
+
+void initInput(inputBuffer* in, int fd)
+{
+    in->fd = fd;
+    in->data = malloc(IO_BUFFER_SIZE);
+    in->pos = in->len = 0;
+    in->eof = 0;
+}
+
+int readInteger(inputBuffer* in, int* value)
+{
+    // returns 0 when there are no more integers, as scanf("%d") does at the end of the input or at a token that
+    // is not an integer (which is left unread, so every later call also returns 0)
+    while(1)
+    {
+        if(in->pos == in->len)
+        {
+            if(in->eof)
+                return 0;
+            refillInput(in);
+            continue;
+        }
+        unsigned char c = in->data[in->pos];
+        if(!isspace(c))
+            break;
+        in->pos++;
+    }
+    if(in->len - in->pos < 32 && in->eof == 0)
+        refillInput(in); // a complete number is now in the buffer
+
+    const char* p = in->data + in->pos;
+    const char* end = in->data + in->len;
+    int negative = (*p == '-');
+    p += (*p == '-' || *p == '+');
+    if(p == end || (unsigned)(*p - '0') >= 10)
+        return 0; // a sign without digits, or not a number at all
+    unsigned long long limit = negative ? 0ull - (unsigned long long)INT_MIN : INT_MAX;
+    unsigned long long x = 0;
+    while(p < end && (unsigned)(*p - '0') < 10)
+    {
+        x = x*10 + (*p++ - '0');
+        if(x > limit)
+            return 0; // does not fit in an int
+    }
+    if(p < end ? !isspace((unsigned char)*p) : in->eof == 0)
+        return 0; // digits followed by something else (1.5, 1e9, 12abc), or a number longer than the buffer
+    in->pos = p - in->data;
+    *value = negative ? (int)(0ull - x) : (int)x;
+    return 1;
+}
+
+int readIntegers(inputBuffer* in, int* arr, int n)
+{
+    int i;
+    for(i=0; i<n && readInteger(in, &arr[i]); i++);
+    return i;
+}
+
+void flushOutput(outputBuffer* out)
+{
+    size_t written = 0;
+    while(written < out->len)
+    {
+        ssize_t w = write(out->fd, out->data + written, out->len - written);
+        if(w <= 0)
+        {
+            perror("write");
+            break;
+        }
+        written += w;
+    }
+    out->len = 0;
+}
+
+void writeInteger(outputBuffer* out, int value, char separator)
+{
+    // two digits per step from a table of all pairs "00".."99"
+    static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    if(out->len + 16 > IO_BUFFER_SIZE)
+        flushOutput(out);
+    char digits[12];
+    char* p = digits + sizeof(digits);
+    unsigned int x = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+    while(x >= 100)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + 2*(x % 100), 2);
+        x /= 100;
+    }
+    if(x >= 10)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + 2*x, 2);
+    }
+    else
+        *--p = '0' + x;
+    if(value < 0)
+        *--p = '-';
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(out->data + out->len, p, len);
+    out->len += len;
+    out->data[out->len++] = separator;
+}
+
+
+// ------------------- HELPER FUNCTIONS -------------------
+int * shareMem(size_t size, int* id){
+    // with --huge-pages, try a SHM_HUGETLB segment, then a hugetlb memfd mapping (*id = -1), then fall back to
+    // normal pages. Both huge page backings need huge pages reserved in /proc/sys/vm/nr_hugepages
+    key_t mem_key = IPC_PRIVATE;
+    if(huge_pages)
+    {
+        size_t huge_size = (size + HUGE_PAGE_SIZE-1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        *id = shmget(mem_key, huge_size, IPC_CREAT | SHM_HUGETLB | 0666);
+        if(*id != -1)
+        {
+            share_backing = "SHM_HUGETLB";
+            return (int*)shmat(*id, NULL, 0);
+        }
+        int fd = memfd_create("mergesort", MFD_HUGETLB);
+        if(fd != -1)
+        {
+            void* mem = MAP_FAILED;
+            if(ftruncate(fd, huge_size) == 0)
+                mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd); // the mapping keeps the memory alive
+            if(mem != MAP_FAILED)
+            {
+                *id = -1;
+                share_backing = "memfd huge pages";
+                return (int*)mem;
+            }
+        }
+    }
+    *id = shmget(mem_key, size, IPC_CREAT | 0666);
+    if(*id == -1)
+    {
+        perror("shmget");
+        exit(1);
+    }
+    int* mem = (int*)shmat(*id, NULL, 0);
+    share_backing = "4K pages";
+    if(huge_pages && madvise(mem, size, MADV_HUGEPAGE) == 0) // used if shmem_enabled allows transparent huge pages
+        share_backing = "4K pages (transparent huge pages requested)";
+    return mem;
+}
+
+void unshareMem(int* mem, size_t size, int id)
+{
+    // releases memory returned by shareMem(size, &id)
+    if(id == -1)
+        munmap(mem, (size + HUGE_PAGE_SIZE-1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    else
+    {
+        shmdt(mem);
+        shmctl(id, IPC_RMID, NULL);
+    }
+}
+
+void printArray(const int* arr, int n)
+{
+    outputBuffer out = {STDOUT_FILENO, malloc(IO_BUFFER_SIZE), 0};
+    fflush(stdout); // keep the order of earlier printf output
+    for(int i=0; i<n; i++)
+        writeInteger(&out, arr[i], ' ');
+    out.data[out.len++] = '\n';
+    flushOutput(&out);
+    free(out.data);
+}
+
+long double getTime(struct timespec ts)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_nsec/(1e9) + ts.tv_sec;
+}
+
+
+// ------------------- PERFORMANCE COUNTERS -------------------
+// compiled out with -DNO_PERF_COUNTERS, otherwise enabled at runtime with --perf
+// every pool worker counts its own thread, the main thread's counters are inherited by forked children and
+// folded back when they exit, so the sum of all of them covers every variant
+# ifndef NO_PERF_COUNTERS
+const char* perf_event_names[NUM_PERF_EVENTS] = {"cycles", "instructions", "cache-misses", "branch-misses",
+                                                 "context-switches", "page-faults", "dTLB-load-misses"};
+
+void perfOpen(perfCounters* pc, int inherit)
+{
+    const struct {
+        unsigned type;
+        unsigned long long config;
+    } events[NUM_PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+    };
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.inherit = inherit;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(pc->fds[i] == -1)
+        {
+            // unprivileged users may only count user space (perf_event_paranoid >= 2)
+            attr.exclude_kernel = attr.exclude_hv = 1;
+            pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+}
+
+void perfClose(perfCounters* pc)
+{
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+        if(pc->fds[i] != -1)
+            close(pc->fds[i]);
+}
+
+void perfAdd(const perfCounters* pc, long long* values)
+{
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+    {
+        unsigned long long data[3]; // value, time enabled, time running
+        if(pc->fds[i] == -1 || values[i] < 0)
+            values[i] = -1;
+        else if(read(pc->fds[i], data, sizeof(data)) == sizeof(data))
+        {
+            // scale up counts of events that were multiplexed with others on the hardware counters
+            if(data[2] > 0 && data[2] < data[1])
+                data[0] = (unsigned long long)((double)data[0] * data[1] / data[2]);
+            values[i] += (long long)data[0];
+        }
+    }
+}
+
+void perfReadAll(long long* values)
+{
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+        values[i] = 0;
+    perfAdd(&perf_main, values);
+    for(int w=0; sort_pool != NULL && w < sort_pool->num_workers; w++)
+        perfAdd(&sort_pool->counters[w], values);
+}
+
+void perfSwitch(perfReport* report, int phase)
+{
+    long long now[NUM_PERF_EVENTS];
+    perfReadAll(now);
+    for(int i=0; i<NUM_PERF_EVENTS && report->phase >= 0; i++)
+        report->values[report->phase][i] = (now[i] < 0) ? -1 : now[i] - report->start[i];
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+        report->start[i] = now[i];
+    report->phase = phase;
+}
+
+void perfStart(perfReport* report, int n)
+{
+    if(perf_enabled == 0)
+        return;
+    memset(report, 0, sizeof(perfReport));
+    report->n = n;
+    report->phase = -1;
+    perfSwitch(report, 0);
+    perf_report = report;
+}
+
+void perfMergePhase(int lb, int ub)
+{
+    // called before every merge, the merge of the whole measured array ends the sort phase
+    perfReport* report = perf_report;
+    if(report != NULL && ub-lb+1 == report->n && report->phase == 0)
+        perfSwitch(report, 1);
+}
+
+void perfStop(perfReport* report)
+{
+    if(perf_enabled == 0)
+        return;
+    perf_report = NULL;
+    perfSwitch(report, -1);
+}
+
+long long perfTotal(const perfReport* report, int event)
+{
+    // count of one event over all phases, -1 if it could not be counted
+    long long total = 0;
+    for(int p=0; p<NUM_PERF_PHASES; p++)
+    {
+        if(perf_enabled == 0 || report->values[p][event] < 0)
+            return -1;
+        total += report->values[p][event];
+    }
+    return total;
+}
+
+void perfPrint(const perfReport* report)
+{
+    const char* phase_names[NUM_PERF_PHASES] = {"sort", "merge"};
+    if(perf_enabled == 0)
+        return;
+    printf("%-8s", "phase");
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+        printf(" %17s", perf_event_names[i]);
+    printf("\n");
+    for(int p=0; p<NUM_PERF_PHASES; p++)
+    {
+        printf("%-8s", phase_names[p]);
+        for(int i=0; i<NUM_PERF_EVENTS; i++)
+        {
+            if(report->values[p][i] < 0)
+                printf(" %17s", "n/a");
+            else
+                printf(" %17lld", report->values[p][i]);
+        }
+        printf("\n");
+    }
+}
+# else
+# define perfOpen(pc, inherit) ((void)0)
+# define perfClose(pc) ((void)0)
+# define perfStart(report, n) ((void)(report))
+# define perfMergePhase(lb, ub) ((void)0)
+# define perfStop(report) ((void)0)
+# define perfPrint(report) ((void)0)
+# define perfTotal(report, event) (-1LL)
+# endif
+
+
+// ------------------- NUMA TOPOLOGY -------------------
+// nodes are read from libnuma when compiled with -DHAVE_LIBNUMA (and linked with -lnuma), otherwise from sysfs
+int nodeOfCpu(int cpu)
+{
+# ifdef HAVE_LIBNUMA
+    if(numa_available() >= 0)
+        return (numa_node_of_cpu(cpu) >= 0) ? numa_node_of_cpu(cpu) : 0;
+# endif
+    // /sys/devices/system/cpu/cpuN contains a nodeM link on NUMA kernels
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    int node = 0;
+    while(dir != NULL && (entry = readdir(dir)) != NULL)
+        if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+            node = atoi(entry->d_name + 4);
+    if(dir != NULL)
+        closedir(dir);
+    return node;
+}
+
+void numaInit()
+{
+    // must run before poolCreate: neighbouring workers are pinned to CPUs of the same node, so neighbouring
+    // partitions (and the merges of low levels) stay on one node
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        perror("sched_getaffinity");
+        return;
+    }
+    worker_cpus = malloc(sizeof(int) * CPU_COUNT(&set));
+    worker_nodes = malloc(sizeof(int) * CPU_COUNT(&set));
+    num_worker_cpus = 0;
+    for(int cpu=0; cpu<CPU_SETSIZE; cpu++)
+    {
+        if(!CPU_ISSET(cpu, &set))
+            continue;
+        int node = nodeOfCpu(cpu), j;
+        for(j=num_worker_cpus; j>0 && worker_nodes[j-1] > node; j--)
+        {
+            worker_cpus[j] = worker_cpus[j-1];
+            worker_nodes[j] = worker_nodes[j-1];
+        }
+        worker_cpus[j] = cpu;
+        worker_nodes[j] = node;
+        num_worker_cpus++;
+    }
+    num_numa_nodes = (num_worker_cpus > 0) ? 1 : 0;
+    for(int i=1; i<num_worker_cpus; i++)
+        num_numa_nodes += (worker_nodes[i] != worker_nodes[i-1]);
+}
+
+void pinWorker(int id)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpus[id % num_worker_cpus], &set);
+    if(sched_setaffinity(0, sizeof(set), &set) != 0)
+        perror("sched_setaffinity");
+}
+
+int sameNode(int w1, int w2)
+{
+    return worker_nodes[w1 % num_worker_cpus] == worker_nodes[w2 % num_worker_cpus];
+}
+
+
+// ------------------- WORK STEALING THREAD POOL -------------------
+void dequePush(taskDeque* dq, task* t)
+{
+    pthread_mutex_lock(&dq->mutex);
+    if(dq->bottom == dq->capacity)
+    {
+        if(dq->top > 0) // reclaim space freed by steals
+        {
+            for(int i=dq->top; i<dq->bottom; i++)
+                dq->tasks[i - dq->top] = dq->tasks[i];
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        }
+        else
+        {
+            dq->capacity *= 2;
+            dq->tasks = realloc(dq->tasks, sizeof(task*) * dq->capacity);
+        }
+    }
+    dq->tasks[dq->bottom++] = t;
+    pthread_mutex_unlock(&dq->mutex);
+}
+
+task* dequePop(taskDeque* dq)
+{
+    task* t = NULL;
+    pthread_mutex_lock(&dq->mutex);
+    if(dq->bottom > dq->top)
+        t = dq->tasks[--dq->bottom];
+    if(dq->bottom == dq->top)
+        dq->top = dq->bottom = 0;
+    pthread_mutex_unlock(&dq->mutex);
+    return t;
+}
+
+task* dequeSteal(taskDeque* dq, int thief)
+{
+    task* t = NULL;
+    pthread_mutex_lock(&dq->mutex);
+    if(dq->bottom > dq->top && (dq->tasks[dq->top]->owner < 0 || dq->tasks[dq->top]->owner == thief))
+        t = dq->tasks[dq->top++];
+    if(dq->bottom == dq->top)
+        dq->top = dq->bottom = 0;
+    pthread_mutex_unlock(&dq->mutex);
+    return t;
+}
+
+task* findTask(threadPool* pool, int self)
+{
+    // newest task from own deque first (depth-first, cache-warm), otherwise steal the oldest (largest) task of another deque
+    // in NUMA mode workers of the same node are robbed first
+    task* t = NULL;
+    if(self >= 0)
+        t = dequePop(&pool->deques[self]);
+    for(int pass=0; pass<((worker_cpus != NULL && self >= 0) ? 2 : 1) && t == NULL; pass++)
+    {
+        for(int i=1; i<=pool->num_deques && t == NULL; i++)
+        {
+            int victim = (self + i + pool->num_deques) % pool->num_deques;
+            if(worker_cpus != NULL && self >= 0 && victim < pool->num_deques-1 && sameNode(self, victim) != (pass == 0))
+                continue;
+            if(pass == 1 && victim == pool->num_deques-1)
+                continue; // the external deque was searched by the first pass
+            t = dequeSteal(&pool->deques[victim], self);
+        }
+    }
+    return t;
+}
+
+void runTask(threadPool* pool, task* t)
+{
+    int notify = t->notify; // t may go out of scope as soon as it is marked done
+    t->function(t->arg);
+    atomic_store(&t->done, 1);
+    if(notify == 0)
+        return;
+    pthread_mutex_lock(&pool->idle_mutex); // wake an external thread that may be waiting on this task
+    pthread_cond_broadcast(&pool->task_done);
+    pthread_mutex_unlock(&pool->idle_mutex);
+}
+
+void* poolWorker(void* input)
+{
+    threadPool* pool = (threadPool*)input;
+    task* t;
+    while(1)
+    {
+        t = findTask(pool, worker_id);
+        if(t != NULL)
+        {
+            runTask(pool, t);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_mutex);
+        atomic_fetch_add(&pool->idle_workers, 1);
+        while((t = findTask(pool, worker_id)) == NULL && atomic_load(&pool->shutdown) == 0)
+            pthread_cond_wait(&pool->work_available, &pool->idle_mutex); // wait for a task to be submitted
+        atomic_fetch_sub(&pool->idle_workers, 1);
+        pthread_mutex_unlock(&pool->idle_mutex);
+
+        if(t == NULL)
+            break; // pool is shutting down
+        runTask(pool, t);
+    }
+    return NULL;
+}
+
+typedef struct workerStart {
+    threadPool* pool;
+    int id;
+} workerStart;
+
+void* poolWorkerStart(void* input)
+{
+    workerStart ws = *(workerStart*)input;
+    free(input);
+    worker_id = ws.id;
+    if(worker_cpus != NULL)
+        pinWorker(ws.id);
+# ifndef NO_PERF_COUNTERS
+    for(int i=0; i<NUM_PERF_EVENTS; i++)
+        ws.pool->counters[ws.id].fds[i] = -1;
+    if(perf_enabled)
+        perfOpen(&ws.pool->counters[ws.id], 0);
+    atomic_fetch_add(&ws.pool->started, 1);
+# endif
+    return poolWorker(ws.pool);
+}
+
+threadPool* poolCreate(int num_workers)
+{
+    threadPool* pool = malloc(sizeof(threadPool));
+    pool->workers = malloc(sizeof(pthread_t) * num_workers);
+    pool->num_deques = num_workers + 1;
+    pool->deques = malloc(sizeof(taskDeque) * pool->num_deques);
+    for(int i=0; i<pool->num_deques; i++)
+    {
+        pool->deques[i].capacity = 64;
+        pool->deques[i].tasks = malloc(sizeof(task*) * 64);
+        pool->deques[i].top = pool->deques[i].bottom = 0;
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+    }
+    atomic_init(&pool->idle_workers, 0);
+    atomic_init(&pool->shutdown, 0);
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->task_done, NULL);
+# ifndef NO_PERF_COUNTERS
+    pool->counters = malloc(sizeof(perfCounters) * num_workers);
+    atomic_init(&pool->started, 0);
+# endif
+
+    pool->num_workers = 0;
+    for(int i=0; i<num_workers; i++)
+    {
+        workerStart* ws = malloc(sizeof(workerStart));
+        ws->pool = pool;
+        ws->id = i;
+        if(pthread_create(&pool->workers[i], NULL, poolWorkerStart, (void*)ws) != 0)
+        {
+            fprintf(stderr, RED "Failed to create worker thread: continuing with %d worker(s)\n" RESET, i);
+            free(ws);
+            break;
+        }
+        pool->num_workers++;
+    }
+# ifndef NO_PERF_COUNTERS
+    while(atomic_load(&pool->started) < pool->num_workers) // counters must exist before the first measurement
+        sched_yield();
+# endif
+    return pool;
+}
+
+void poolDestroy(threadPool* pool)
+{
+    pthread_mutex_lock(&pool->idle_mutex);
+    atomic_store(&pool->shutdown, 1);
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->idle_mutex);
+    for(int i=0; i<pool->num_workers; i++)
+        pthread_join(pool->workers[i], NULL);
+# ifndef NO_PERF_COUNTERS
+    for(int i=0; i<pool->num_workers; i++)
+        perfClose(&pool->counters[i]);
+    free(pool->counters);
+# endif
+    for(int i=0; i<pool->num_deques; i++)
+    {
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].mutex);
+    }
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+void poolSpawn(threadPool* pool, task* t, void* (*function)(void*), void* arg)
+{
+    t->function = function;
+    t->arg = arg;
+    t->notify = (worker_id < 0);
+    t->owner = -1;
+    atomic_init(&t->done, 0);
+    dequePush(&pool->deques[worker_id >= 0 ? worker_id : pool->num_deques - 1], t);
+    if(atomic_load(&pool->idle_workers) > 0)
+    {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->work_available); // signal that a task is ready to be stolen
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+}
+
+void poolSync(threadPool* pool, task* t)
+{
+    // keep executing other tasks (most likely t itself) until t has completed
+    while(atomic_load(&t->done) == 0)
+    {
+        task* other = findTask(pool, worker_id);
+        if(other != NULL)
+            runTask(pool, other);
+        else
+            sched_yield();
+    }
+}
+
+void poolWait(threadPool* pool, task* t)
+{
+    // block a thread outside the pool until the root task t, submitted by that thread, has completed
+    pthread_mutex_lock(&pool->idle_mutex);
+    while(atomic_load(&t->done) == 0)
+        pthread_cond_wait(&pool->task_done, &pool->idle_mutex);
+    pthread_mutex_unlock(&pool->idle_mutex);
+}
+
+void poolRun(threadPool* pool, void* (*function)(void*), void* arg)
+{
+    // submit a root task from outside the pool and block until it completes
+    if(pool->num_workers == 0)
+    {
+        function(arg);
+        return;
+    }
+    task t;
+    poolSpawn(pool, &t, function, arg);
+    poolWait(pool, &t);
+}
+
+void* poolForRange(void* input)
+{
+    rangeTask* rt = (rangeTask*)input;
+    if(rt->hi - rt->lo > 1)
+    {
+        int mid = rt->lo + (rt->hi - rt->lo)/2;
+        task left;
+        rangeTask rt1 = *rt, rt2 = *rt;
+        rt1.hi = mid;
+        rt2.lo = mid;
+
+        poolSpawn(sort_pool, &left, poolForRange, (void*)(&rt1));
+        poolForRange((void*)(&rt2));
+        poolSync(sort_pool, &left);
+    }
+    else if(rt->hi > rt->lo)
+        rt->body(rt->ctx, rt->lo);
+    return NULL;
+}
+
+void poolForEachWorker(void (*body)(void* ctx, int w), void* ctx)
+{
+    // runs body(ctx, w) on worker w of sort_pool for every worker, called from outside the pool
+    // the tasks are pinned: they can not be stolen, so w's memory accesses come from w's CPU (and node)
+    threadPool* pool = sort_pool;
+    if(pool->num_workers == 0)
+    {
+        body(ctx, 0);
+        return;
+    }
+    task* tasks = malloc(sizeof(task) * pool->num_workers);
+    rangeTask* ranges = malloc(sizeof(rangeTask) * pool->num_workers);
+    for(int w=0; w<pool->num_workers; w++)
+    {
+        ranges[w] = (rangeTask){w, w+1, body, ctx};
+        tasks[w].function = poolForRange;
+        tasks[w].arg = (void*)(&ranges[w]);
+        tasks[w].notify = 1;
+        tasks[w].owner = w;
+        atomic_init(&tasks[w].done, 0);
+        dequePush(&pool->deques[w], &tasks[w]);
+    }
+    pthread_mutex_lock(&pool->idle_mutex);
+    pthread_cond_broadcast(&pool->work_available);
+    for(int w=0; w<pool->num_workers; w++)
+        while(atomic_load(&tasks[w].done) == 0)
+            pthread_cond_wait(&pool->task_done, &pool->idle_mutex);
+    pthread_mutex_unlock(&pool->idle_mutex);
+    free(tasks);
+    free(ranges);
+}
+
+void poolFor(int lo, int hi, void (*body)(void* ctx, int i), void* ctx)
+{
+    // runs body(ctx, i) for every i in [lo, hi) on sort_pool, from inside or outside the pool
+    rangeTask rt = {lo, hi, body, ctx};
+    if(worker_id >= 0)
+        poolForRange((void*)(&rt));
+    else
+        poolRun(sort_pool, poolForRange, (void*)(&rt));
+}
+
+
+// ------------------- INSERTION SORT IMPLEMENTATION -------------------
+void insertionSort(int* arr, int lb, int ub)
+{
+    int key, j;
+    for(int i=lb+1; i<=ub; i++)
+    {
+        key = arr[i];
+        for(j=i-1; j>=lb && arr[j] > key; j--)
+            arr[j+1] = arr[j];
+        arr[j+1] = key;
+    }
+}
+
+
+// ------------------- SIMD SORTING NETWORK KERNELS -------------------
+// small blocks are sorted and runs are merged by bitonic networks of min/max instructions instead of branches,
+// the widest instruction set supported by the CPU is picked at startup by initKernels
+void mergeRunsScalar(const int* a, int len1, const int* b, int len2, int* out)
+{
+    // merge the sorted runs a[0..len1-1] and b[0..len2-1] into out (elements of a come first on ties)
+    int i = 0, j = 0, k = 0;
+    while(i < len1 && j < len2)
+    {
+        if(b[j] < a[i])
+            out[k++] = b[j++];
+        else
+            out[k++] = a[i++];
+    }
+    while(i < len1)
+        out[k++] = a[i++];
+    while(j < len2)
+        out[k++] = b[j++];
+}
+
+void sortSmallScalar(int* arr, int len)
+{
+    insertionSort(arr, 0, len-1);
+}
+
+void mergeTail(const int* reg, int len0, const int* a, int len1, const int* b, int len2, int* out)
+{
+    // three way merge of the elements left in a vector register with the ends of both runs
+    int t = 0, i = 0, j = 0, k = 0;
+    while(t < len0 || i < len1 || j < len2)
+    {
+        if(t < len0 && (i >= len1 || reg[t] <= a[i]) && (j >= len2 || reg[t] <= b[j]))
+            out[k++] = reg[t++];
+        else if(i < len1 && (j >= len2 || a[i] <= b[j]))
+            out[k++] = a[i++];
+        else
+            out[k++] = b[j++];
+    }
+}
+
+# if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline __m256i compareExchange8(__m256i v, __m256i perm, __m256i max_lanes)
+{
+    // compare every lane with the lane given by perm, lanes set in max_lanes keep the larger value
+    __m256i p = _mm256_permutevar8x32_epi32(v, perm);
+    return _mm256_blendv_epi8(_mm256_min_epi32(v, p), _mm256_max_epi32(v, p), max_lanes);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sortVector8(__m256i v)
+{
+    // bitonic sorting network for 8 elements (6 stages)
+    const __m256i dist1 = _mm256_setr_epi32(1, 0, 3, 2, 5, 4, 7, 6);
+    const __m256i dist2 = _mm256_setr_epi32(2, 3, 0, 1, 6, 7, 4, 5);
+    const __m256i dist4 = _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3);
+    v = compareExchange8(v, dist1, _mm256_setr_epi32(0, -1, -1, 0, 0, -1, -1, 0));
+    v = compareExchange8(v, dist2, _mm256_setr_epi32(0, 0, -1, -1, -1, -1, 0, 0));
+    v = compareExchange8(v, dist1, _mm256_setr_epi32(0, -1, 0, -1, -1, 0, -1, 0));
+    v = compareExchange8(v, dist4, _mm256_setr_epi32(0, 0, 0, 0, -1, -1, -1, -1));
+    v = compareExchange8(v, dist2, _mm256_setr_epi32(0, 0, -1, -1, 0, 0, -1, -1));
+    v = compareExchange8(v, dist1, _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1));
+    return v;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i bitonicClean8(__m256i v)
+{
+    // sorts a bitonic sequence of 8 elements
+    v = compareExchange8(v, _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3), _mm256_setr_epi32(0, 0, 0, 0, -1, -1, -1, -1));
+    v = compareExchange8(v, _mm256_setr_epi32(2, 3, 0, 1, 6, 7, 4, 5), _mm256_setr_epi32(0, 0, -1, -1, 0, 0, -1, -1));
+    v = compareExchange8(v, _mm256_setr_epi32(1, 0, 3, 2, 5, 4, 7, 6), _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1));
+    return v;
+}
+
+__attribute__((target("avx2")))
+static inline void bitonicMerge8(__m256i a, __m256i b, __m256i* lo, __m256i* hi)
+{
+    // merges two sorted vectors into the 8 smallest (lo) and 8 largest (hi) elements, both sorted
+    b = _mm256_permutevar8x32_epi32(b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    *lo = bitonicClean8(_mm256_min_epi32(a, b));
+    *hi = bitonicClean8(_mm256_max_epi32(a, b));
+}
+
+__attribute__((target("avx2")))
+void sortSmallAVX2(int* arr, int len)
+{
+    int tmp[8];
+    for(int i=0; i<8; i++)
+        tmp[i] = (i < len) ? arr[i] : INT_MAX; // padding sorts to the end
+    __m256i v = sortVector8(_mm256_loadu_si256((__m256i*)tmp));
+    _mm256_storeu_si256((__m256i*)tmp, v);
+    for(int i=0; i<len; i++)
+        arr[i] = tmp[i];
+}
+
+__attribute__((target("avx2")))
+void mergeRunsAVX2(const int* a, int len1, const int* b, int len2, int* out)
+{
+    if(len1 < 8 || len2 < 8)
+    {
+        mergeRunsScalar(a, len1, b, len2, out);
+        return;
+    }
+    // the register hi always holds the 8 largest elements merged so far, which are merged with the next block
+    // of whichever run has the smaller head
+    __m256i lo, hi, next;
+    int i = 8, j = 8, k = 8;
+    bitonicMerge8(_mm256_loadu_si256((__m256i*)a), _mm256_loadu_si256((__m256i*)b), &lo, &hi);
+    _mm256_storeu_si256((__m256i*)out, lo);
+    while(i+8 <= len1 && j+8 <= len2)
+    {
+        if(a[i] <= b[j])
+            next = _mm256_loadu_si256((__m256i*)(a+i)), i += 8;
+        else
+            next = _mm256_loadu_si256((__m256i*)(b+j)), j += 8;
+        bitonicMerge8(next, hi, &lo, &hi);
+        _mm256_storeu_si256((__m256i*)(out+k), lo);
+        k += 8;
+    }
+    int reg[8];
+    _mm256_storeu_si256((__m256i*)reg, hi);
+    mergeTail(reg, 8, a+i, len1-i, b+j, len2-j, out+k);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i compareExchange4(__m128i v, __m128i p, __m128i max_lanes)
+{
+    return _mm_blendv_epi8(_mm_min_epi32(v, p), _mm_max_epi32(v, p), max_lanes);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i sortVector4(__m128i v)
+{
+    // bitonic sorting network for 4 elements (3 stages)
+    v = compareExchange4(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_epi32(0, -1, -1, 0));
+    v = compareExchange4(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)), _mm_setr_epi32(0, 0, -1, -1));
+    v = compareExchange4(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_epi32(0, -1, 0, -1));
+    return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i bitonicClean4(__m128i v)
+{
+    v = compareExchange4(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)), _mm_setr_epi32(0, 0, -1, -1));
+    v = compareExchange4(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_epi32(0, -1, 0, -1));
+    return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline void bitonicMerge4(__m128i a, __m128i b, __m128i* lo, __m128i* hi)
+{
+    b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3));
+    *lo = bitonicClean4(_mm_min_epi32(a, b));
+    *hi = bitonicClean4(_mm_max_epi32(a, b));
+}
+
+__attribute__((target("sse4.1")))
+void sortSmallSSE4(int* arr, int len)
+{
+    int tmp[8];
+    for(int i=0; i<8; i++)
+        tmp[i] = (i < len) ? arr[i] : INT_MAX;
+    __m128i lo, hi;
+    bitonicMerge4(sortVector4(_mm_loadu_si128((__m128i*)tmp)), sortVector4(_mm_loadu_si128((__m128i*)(tmp+4))), &lo, &hi);
+    _mm_storeu_si128((__m128i*)tmp, lo);
+    _mm_storeu_si128((__m128i*)(tmp+4), hi);
+    for(int i=0; i<len; i++)
+        arr[i] = tmp[i];
+}
+
+__attribute__((target("sse4.1")))
+void mergeRunsSSE4(const int* a, int len1, const int* b, int len2, int* out)
+{
+    if(len1 < 4 || len2 < 4)
+    {
+        mergeRunsScalar(a, len1, b, len2, out);
+        return;
+    }
+    __m128i lo, hi, next;
+    int i = 4, j = 4, k = 4;
+    bitonicMerge4(_mm_loadu_si128((__m128i*)a), _mm_loadu_si128((__m128i*)b), &lo, &hi);
+    _mm_storeu_si128((__m128i*)out, lo);
+    while(i+4 <= len1 && j+4 <= len2)
+    {
+        if(a[i] <= b[j])
+            next = _mm_loadu_si128((__m128i*)(a+i)), i += 4;
+        else
+            next = _mm_loadu_si128((__m128i*)(b+j)), j += 4;
+        bitonicMerge4(next, hi, &lo, &hi);
+        _mm_storeu_si128((__m128i*)(out+k), lo);
+        k += 4;
+    }
+    int reg[4];
+    _mm_storeu_si128((__m128i*)reg, hi);
+    mergeTail(reg, 4, a+i, len1-i, b+j, len2-j, out+k);
+}
+# endif
+
+void (*sortSmall)(int* arr, int len) = sortSmallScalar; // sorts at most SMALL_SORT_SIZE elements
+void (*mergeRunsKernel)(const int* a, int len1, const int* b, int len2, int* out) = mergeRunsScalar;
+
+void initKernels()
+{
+# if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        sortSmall = sortSmallAVX2, mergeRunsKernel = mergeRunsAVX2;
+    else if(__builtin_cpu_supports("sse4.1"))
+        sortSmall = sortSmallSSE4, mergeRunsKernel = mergeRunsSSE4;
+# endif
+}
+
+
+// ------------------- LEAF SORT STRATEGIES -------------------
+// a leaf sorts arr[0..len-1] (len <= leaf_cutoff) and leaves the result in arr (to_buf = 0) or buf (to_buf = 1)
+void mergePasses(int* arr, int* buf, int len, int width, int to_buf)
+{
+    // bottom-up merge of sorted runs of width elements, alternating between arr and buf
+    int *src = arr, *dst = buf, *tmp;
+    for(; width < len; width *= 2)
+    {
+        for(int i=0; i<len; i+=2*width)
+        {
+            int mid = (i+width < len) ? i+width : len;
+            int end = (i+2*width < len) ? i+2*width : len;
+            mergeRunsKernel(src+i, mid-i, src+mid, end-mid, dst+i);
+        }
+        tmp = src, src = dst, dst = tmp;
+    }
+    if((src == buf) != to_buf)
+        for(int i=0; i<len; i++)
+            dst[i] = src[i];
+}
+
+void leafInsertion(int* arr, int* buf, int len, int to_buf)
+{
+    insertionSort(arr, 0, len-1);
+    for(int i=0; to_buf && i<len; i++)
+        buf[i] = arr[i];
+}
+
+void leafNetwork(int* arr, int* buf, int len, int to_buf)
+{
+    for(int i=0; i<len; i+=SMALL_SORT_SIZE)
+        sortSmall(arr+i, (len-i < SMALL_SORT_SIZE) ? len-i : SMALL_SORT_SIZE);
+    mergePasses(arr, buf, len, SMALL_SORT_SIZE, to_buf);
+}
+
+void leafNatural(int* arr, int* buf, int len, int to_buf)
+{
+    // split into ascending runs (strictly descending runs are reversed) and merge neighbouring runs
+    int runs[MAX_LEAF_CUTOFF+1], num_runs = 0, i = 0;
+    while(i < len)
+    {
+        int j = i+1;
+        if(j < len && arr[j] < arr[i])
+        {
+            while(j+1 < len && arr[j+1] < arr[j])
+                j++;
+            for(int x=i, y=j; x<y; x++, y--)
+            {
+                int t = arr[x];
+                arr[x] = arr[y];
+                arr[y] = t;
+            }
+            j++;
+        }
+        else
+            while(j < len && arr[j] >= arr[j-1])
+                j++;
+        runs[num_runs++] = i;
+        i = j;
+    }
+    runs[num_runs] = len;
+
+    int *src = arr, *dst = buf, *tmp;
+    while(num_runs > 1)
+    {
+        int merged = 0;
+        for(int r=0; r<num_runs; r+=2, merged++)
+        {
+            int start = runs[r], mid = runs[r+1], end = (r+2 <= num_runs) ? runs[r+2] : mid;
+            mergeRunsKernel(src+start, mid-start, src+mid, end-mid, dst+start);
+            runs[merged] = start;
+        }
+        runs[merged] = len;
+        num_runs = merged;
+        tmp = src, src = dst, dst = tmp;
+    }
+    if((src == buf) != to_buf)
+        for(int x=0; x<len; x++)
+            dst[x] = src[x];
+}
+
+typedef struct leafStrategy {
+    const char* name;
+    void (*sort)(int* arr, int* buf, int len, int to_buf);
+} leafStrategy;
+
+leafStrategy leaf_strategies[] = {
+    {"insertion", leafInsertion},
+    {"network", leafNetwork},
+    {"natural", leafNatural}
+};
+# define NUM_LEAF_STRATEGIES (int)(sizeof(leaf_strategies) / sizeof(leafStrategy))
+
+void (*leafSort)(int* arr, int* buf, int len, int to_buf) = leafNetwork;
+int leaf_cutoff = DEFAULT_LEAF_CUTOFF; // segments of at most this many elements are sorted by leafSort
+
+
+// ------------------- MERGESORT IMPLEMENTATIONS -------------------
+void mergeRuns(const int* a, int len1, const int* b, int len2, int* out)
+{
+    mergeRunsKernel(a, len1, b, len2, out);
+}
+
+void merge(const int* src, int* dst, int lb, int mid, int ub)
+{
+    // merge the sorted runs src[lb..mid] and src[mid+1..ub] into dst[lb..ub]
+    mergeRuns(src+lb, mid-lb+1, src+mid+1, ub-mid, dst+lb);
+}
+
+int coRank(int k, const int* a, int len1, const int* b, int len2)
+{
+    // number of elements of a among the first k elements of the merge of a and b (binary search)
+    int lo = (k - len2 > 0) ? k - len2 : 0;
+    int hi = (k < len1) ? k : len1;
+    while(lo < hi)
+    {
+        int i = lo + (hi-lo)/2;
+        if(a[i] <= b[k-i-1])
+            lo = i+1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+void mergeSlice(const int* src, int* dst, int lb, int mid, int ub, int out_lb, int out_ub)
+{
+    // produce only dst[out_lb..out_ub] of the merge of src[lb..mid] and src[mid+1..ub]
+    const int* a = src+lb;
+    const int* b = src+mid+1;
+    int len1 = mid-lb+1, len2 = ub-mid;
+    int i1 = coRank(out_lb-lb, a, len1, b, len2), j1 = out_lb-lb - i1;
+    int i2 = coRank(out_ub+1-lb, a, len1, b, len2), j2 = out_ub+1-lb - i2;
+    mergeRuns(a+i1, i2-i1, b+j1, j2-j1, dst+out_lb);
+}
+
+void* parallelMerge(void* input)
+{
+    // output range is halved recursively and every half is co-ranked and merged independently by any worker
+    mergeInfo* mi = (mergeInfo*)input;
+    if(mi->out_ub - mi->out_lb + 1 > SEQUENTIAL_CUTOFF)
+    {
+        int out_mid = mi->out_lb + (mi->out_ub - mi->out_lb)/2;
+        task left;
+        mergeInfo mi1 = *mi, mi2 = *mi;
+        mi1.out_ub = out_mid;
+        mi2.out_lb = out_mid+1;
+
+        poolSpawn(sort_pool, &left, parallelMerge, (void*)(&mi1));
+        parallelMerge((void*)(&mi2));
+        poolSync(sort_pool, &left);
+    }
+    else
+        mergeSlice(mi->src, mi->dst, mi->lb, mi->mid, mi->ub, mi->out_lb, mi->out_ub);
+    return NULL;
+}
+
+void concurrentMerge(const int* src, int* dst, int lb, int mid, int ub, int out_lb, int out_ub, int procs)
+{
+    // output range is split between procs processes, each co-ranking and merging its own slice of shared memory
+    if(procs > 1 && out_ub-out_lb+1 >= min_fork_segment)
+    {
+        int out_mid = out_lb + (out_ub-out_lb)/2;
+        int pid = fork();
+        if(pid == 0)
+        {
+            concurrentMerge(src, dst, lb, mid, ub, out_lb, out_mid, procs/2);
+            _exit(0);
+        }
+        if(pid == -1)
+            mergeSlice(src, dst, lb, mid, ub, out_lb, out_mid);
+        concurrentMerge(src, dst, lb, mid, ub, out_mid+1, out_ub, procs - procs/2);
+        if(pid > 0)
+            waitpid(pid, NULL, 0);
+    }
+    else
+        mergeSlice(src, dst, lb, mid, ub, out_lb, out_ub);
+}
+
+void mergeSortTo(int* arr, int* buf, int lb, int ub, int to_buf)
+{
+    // sorts arr[lb..ub] into arr (to_buf = 0) or buf (to_buf = 1), the other array is used as scratch space
+    // consecutive levels alternate between arr and buf, so no level copies its input before merging
+    if(ub-lb+1 > leaf_cutoff)
+    {
+        int mid = lb + (ub-lb)/2;
+        mergeSortTo(arr, buf, lb, mid, !to_buf);
+        mergeSortTo(arr, buf, mid+1, ub, !to_buf);
+        perfMergePhase(lb, ub);
+        if(to_buf)
+            merge(arr, buf, lb, mid, ub);
+        else
+            merge(buf, arr, lb, mid, ub);
+    }
+    else
+        leafSort(arr+lb, buf+lb, ub-lb+1, to_buf);
+}
+
+void normalMergeSort(int* arr, int lb, int ub)
+{
+    int* buf = malloc(sizeof(int) * (ub-lb+1));
+    if(buf == NULL)
+    {
+        fprintf(stderr, RED "Failed to allocate merge buffer\n" RESET);
+        exit(1);
+    }
+    mergeSortTo(arr + lb, buf, 0, ub-lb, 0);
+    free(buf);
+}
+
+void concurrentMergeSort(int* arr, int* buf, int lb, int ub, int depth, int to_buf)
+{
+    // fork only until there is one leaf process per core, each leaf sorts its segment of shared memory sequentially
+    if(depth < max_fork_depth && ub-lb+1 >= min_fork_segment)
+    {
+        int mid = lb + (ub-lb)/2;
+        int pid = fork();
+        if(pid == -1)
+        {
+            fprintf(stderr, RED "Failed to fork child process: defaulting to normal merge sort\n" RESET);
+            mergeSortTo(arr, buf, lb, ub, to_buf);
+            return;
+        }
+        if(pid == 0)
+        {
+            concurrentMergeSort(arr, buf, lb, mid, depth+1, !to_buf);
+            _exit(0); // do not flush stdio buffers inherited from the parent
+        }
+        else
+        {
+            concurrentMergeSort(arr, buf, mid+1, ub, depth+1, !to_buf);
+            waitpid(pid, NULL, 0);
+            perfMergePhase(lb, ub);
+            // all the leaf processes below this level are done, so their cores take part in the merge
+            if(ub-lb+1 > PARALLEL_MERGE_THRESHOLD)
+                concurrentMerge(to_buf ? arr : buf, to_buf ? buf : arr, lb, mid, ub, lb, ub, 1 << (max_fork_depth - depth));
+            else if(to_buf)
+                merge(arr, buf, lb, mid, ub);
+            else
+                merge(buf, arr, lb, mid, ub);
+        }
+    }
+    else
+        mergeSortTo(arr, buf, lb, ub, to_buf);
+}
+
+void* threadedMergeSort(void* input)
+{
+    arrayInfo* ai = (arrayInfo*)input;
+    int lb = ai->lb;
+    int ub = ai->ub;
+    int* arr = ai->arr;
+    int* buf = ai->buf;
+    int to_buf = ai->to_buf;
+
+    if(ub-lb+1 > SEQUENTIAL_CUTOFF)
+    {
+        // left half is pushed to this worker's deque (where idle workers can steal it), right half is sorted here
+        int mid = lb + (ub-lb)/2;
+        task left;
+        arrayInfo ai1 = {lb, mid, arr, buf, !to_buf};
+        arrayInfo ai2 = {mid+1, ub, arr, buf, !to_buf};
+
+        poolSpawn(sort_pool, &left, threadedMergeSort, (void*)(&ai1));
+        threadedMergeSort((void*)(&ai2));
+        poolSync(sort_pool, &left);
+        perfMergePhase(lb, ub);
+
+        mergeInfo mi = {to_buf ? arr : buf, to_buf ? buf : arr, lb, mid, ub, lb, ub};
+        if(ub-lb+1 > PARALLEL_MERGE_THRESHOLD)
+            parallelMerge((void*)(&mi));
+        else
+            merge(mi.src, mi.dst, lb, mid, ub);
+    }
+    else
+        mergeSortTo(arr, buf, lb, ub, to_buf);
+
+    return NULL;
+}
+
+void parallelMergeSort(int* arr, int n)
+{
+    // sorts arr[0..n-1] on sort_pool with a temporary n-sized merge buffer
+    int* buf = malloc(sizeof(int) * (n > 0 ? n : 1));
+    if(buf == NULL)
+    {
+        fprintf(stderr, RED "Failed to allocate merge buffer\n" RESET);
+        exit(1);
+    }
+    arrayInfo ai = {0, n-1, arr, buf, 0};
+    poolRun(sort_pool, threadedMergeSort, (void*)(&ai));
+    free(buf);
+}
+
+
+// ------------------- BOTTOM-UP MERGESORT IMPLEMENTATION -------------------
+// iterative mergesort: blocks that fit in the L2 cache along with their share of buf are sorted in parallel, then every
+// pass merges MERGE_WAYS runs at a time, so the array goes through memory log_MERGE_WAYS(n / block) times instead of
+// log2(n / block) times. The output of every pass is cut into one equal part per worker, wherever the runs start
+int countAtMost(const int* a, int len, long long x)
+{
+    int lo = 0, hi = len;
+    while(lo < hi)
+    {
+        int mid = lo + (hi-lo)/2;
+        if(a[mid] <= x)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void splitRuns(const int* src, const int* start, const int* end, int k, int rank, int* pos)
+{
+    // pos[i] = end of the part of run src[start[i]..end[i]-1] among the rank smallest elements of the k runs
+    // (the multiway counterpart of coRank), found by a binary search for the value of rank
+    long long lo = INT_MIN, hi = INT_MAX;
+    while(lo < hi)
+    {
+        long long x = lo + (hi-lo)/2;
+        long long count = 0;
+        for(int i=0; i<k; i++)
+            count += countAtMost(src + start[i], end[i] - start[i], x);
+        if(count >= rank)
+            hi = x;
+        else
+            lo = x+1;
+    }
+    // every element smaller than lo is taken, equal ones are taken from the first runs until rank is reached
+    int taken = 0;
+    for(int i=0; i<k; i++)
+    {
+        pos[i] = start[i] + countAtMost(src + start[i], end[i] - start[i], lo-1);
+        taken += pos[i] - start[i];
+    }
+    for(int i=0; i<k && taken<rank; i++)
+    {
+        int equal = start[i] + countAtMost(src + start[i], end[i] - start[i], lo) - pos[i];
+        int take = (equal < rank - taken) ? equal : rank - taken;
+        pos[i] += take;
+        taken += take;
+    }
+}
+
+void multiwayMerge(const int* src, const int* from, const int* to, int k, int* out, int* scratch)
+{
+    // merges the runs src[from[i]..to[i]-1] into out, MERGE_SLICE output elements at a time: the pieces of the k runs
+    // that make up a slice are merged pairwise with the SIMD kernel through scratch (2 * MERGE_SLICE elements), so
+    // only the last merge of every slice writes to memory outside the cache
+    int len = 0, pos[MAX_MERGE_WAYS], next[MAX_MERGE_WAYS], piece_len[MAX_MERGE_WAYS];
+    const int* piece[MAX_MERGE_WAYS];
+    for(int i=0; i<k; i++)
+    {
+        len += to[i] - from[i];
+        pos[i] = from[i];
+    }
+    for(int done=0; done<len; done+=MERGE_SLICE)
+    {
+        int slice = (len - done < MERGE_SLICE) ? len - done : MERGE_SLICE;
+        splitRuns(src, from, to, k, done + slice, next);
+        int m = k;
+        for(int i=0; i<k; i++)
+        {
+            piece[i] = src + pos[i];
+            piece_len[i] = next[i] - pos[i];
+            pos[i] = next[i];
+        }
+        for(int round=0; m>2; round++)
+        {
+            int* dst = scratch + (round % 2) * MERGE_SLICE;
+            for(int i=0; i<m; i+=2)
+            {
+                int merged = piece_len[i] + ((i+1 < m) ? piece_len[i+1] : 0);
+                if(i+1 < m)
+                    mergeRunsKernel(piece[i], piece_len[i], piece[i+1], piece_len[i+1], dst);
+                else
+                    memcpy(dst, piece[i], sizeof(int) * merged); // the other area is overwritten next round
+                piece[i/2] = dst;
+                piece_len[i/2] = merged;
+                dst += merged;
+            }
+            m = (m+1) / 2;
+        }
+        if(m == 2)
+            mergeRunsKernel(piece[0], piece_len[0], piece[1], piece_len[1], out + done);
+        else
+            memcpy(out + done, piece[0], sizeof(int) * slice);
+    }
+}
+
+void bottomUpSortBlock(void* input, int b)
+{
+    bottomUpInfo* bi = (bottomUpInfo*)input;
+    int lb = b * bi->block, ub = (bi->n - lb > bi->block) ? lb + bi->block - 1 : bi->n - 1;
+    mergeSortTo(bi->arr, bi->buf, lb, ub, bi->to_buf);
+}
+
+void bottomUpMergePart(void* input, int w)
+{
+    // merges the w-th part of the output of the current pass, which may cover the end of one group of runs and the
+    // start of the next ones
+    bottomUpInfo* bi = (bottomUpInfo*)input;
+    long long lo = (long long)bi->n * w / bi->num_parts, hi = (long long)bi->n * (w+1) / bi->num_parts;
+    long long group = bi->width * MERGE_WAYS;
+    int start[MAX_MERGE_WAYS], end[MAX_MERGE_WAYS], from[MAX_MERGE_WAYS], to[MAX_MERGE_WAYS];
+    int* scratch = malloc(sizeof(int) * 2 * MERGE_SLICE);
+    for(long long g = lo / group * group; g < hi; g += group)
+    {
+        int k = 0;
+        for(long long r = g; r < g + group && r < bi->n; r += bi->width, k++)
+        {
+            start[k] = (int)r;
+            end[k] = (int)((r + bi->width < bi->n) ? r + bi->width : bi->n);
+        }
+        int first = (int)(((lo > g) ? lo : g) - g);
+        int last = (int)(((hi < g + group) ? hi : g + group) - g);
+        if(last > bi->n - g)
+            last = (int)(bi->n - g);
+        splitRuns(bi->src, start, end, k, first, from);
+        splitRuns(bi->src, start, end, k, last, to);
+        multiwayMerge(bi->src, from, to, k, bi->dst + g + first, scratch);
+    }
+    free(scratch);
+}
+
+void bottomUpMergeSort(int* arr, int* buf, int n)
+{
+    // sorts arr[0..n-1] on sort_pool from outside the pool, buf holds at least n elements
+    if(n < 2)
+        return;
+    long cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    bottomUpInfo bi = {arr, buf, NULL, NULL, n, (cache_size > 0) ? (int)(cache_size / (2 * sizeof(int))) : 65536, 0, 0,
+                       (sort_pool->num_workers > 0) ? sort_pool->num_workers : 1};
+    if(bi.block < SEQUENTIAL_CUTOFF)
+        bi.block = SEQUENTIAL_CUTOFF;
+
+    // the blocks are sorted into whichever array the last pass reads from, so the result ends up in arr
+    int passes = 0;
+    for(long long width = bi.block; width < n; width *= MERGE_WAYS)
+        passes++;
+    bi.to_buf = passes % 2;
+    poolFor(0, (int)(((long long)n + bi.block-1) / bi.block), bottomUpSortBlock, (void*)(&bi));
+
+    bi.src = bi.to_buf ? buf : arr;
+    bi.dst = bi.to_buf ? arr : buf;
+    for(bi.width = bi.block; bi.width < n; bi.width *= MERGE_WAYS)
+    {
+        poolForEachWorker(bottomUpMergePart, (void*)(&bi));
+        int* tmp = bi.dst;
+        bi.dst = (int*)bi.src;
+        bi.src = tmp;
+    }
+}
+
+
+// ------------------- RADIX SORT IMPLEMENTATION -------------------
+// LSD radix sort: every pass splits the array into one chunk per worker, counts the digits of every chunk
+// in parallel, turns the counts into per-chunk output offsets and scatters every chunk in parallel
+void radixHistogram(void* input, int c)
+{
+    radixInfo* ri = (radixInfo*)input;
+    int* count = ri->counts + (size_t)c * ri->num_digits;
+    int lo = (int)((long long)ri->n * c / ri->num_chunks), hi = (int)((long long)ri->n * (c+1) / ri->num_chunks);
+    for(int d=0; d<ri->num_digits; d++)
+        count[d] = 0;
+    for(int i=lo; i<hi; i++)
+        count[(((unsigned)ri->src[i] ^ 0x80000000u) >> ri->shift) & (ri->num_digits - 1)]++;
+}
+
+void radixScatter(void* input, int c)
+{
+    // elements are staged in one cache line per digit and written out a full line at a time
+    radixInfo* ri = (radixInfo*)input;
+    int* offset = ri->counts + (size_t)c * ri->num_digits;
+    int lo = (int)((long long)ri->n * c / ri->num_chunks), hi = (int)((long long)ri->n * (c+1) / ri->num_chunks);
+    int (*lines)[RADIX_LINE] = malloc(sizeof(int) * RADIX_LINE * ri->num_digits);
+    unsigned char* fill = calloc(ri->num_digits, 1);
+    for(int i=lo; i<hi; i++)
+    {
+        int x = ri->src[i];
+        int d = (((unsigned)x ^ 0x80000000u) >> ri->shift) & (ri->num_digits - 1);
+        lines[d][fill[d]++] = x;
+        if(fill[d] == RADIX_LINE)
+        {
+            memcpy(ri->dst + offset[d], lines[d], sizeof(lines[d]));
+            offset[d] += RADIX_LINE;
+            fill[d] = 0;
+        }
+    }
+    for(int d=0; d<ri->num_digits; d++)
+        memcpy(ri->dst + offset[d], lines[d], sizeof(int) * fill[d]);
+    free(lines);
+    free(fill);
+}
+
+void radixSort(int* arr, int* buf, int n)
+{
+    // sorts arr[0..n-1] using buf as scratch space, radix_bits bits per pass (the sign bit is flipped)
+    int num_chunks = sort_pool->num_workers > 0 ? sort_pool->num_workers : 1;
+    if(n < num_chunks * RADIX_LINE * 16)
+        num_chunks = 1;
+    radixInfo ri = {arr, buf, n, num_chunks, 1 << radix_bits, 0, NULL};
+    ri.counts = malloc(sizeof(int) * num_chunks * ri.num_digits);
+
+    for(ri.shift=0; ri.shift<32; ri.shift+=radix_bits)
+    {
+        poolFor(0, num_chunks, radixHistogram, (void*)&ri);
+
+        // exclusive prefix sum over (digit, chunk), a pass where every element has the same digit is skipped
+        int total = 0, skip = 0;
+        for(int d=0; d<ri.num_digits; d++)
+        {
+            int digit_total = 0;
+            for(int c=0; c<num_chunks; c++)
+            {
+                int count = ri.counts[(size_t)c * ri.num_digits + d];
+                ri.counts[(size_t)c * ri.num_digits + d] = total;
+                total += count;
+                digit_total += count;
+            }
+            if(digit_total == n)
+                skip = 1;
+        }
+        if(skip)
+            continue;
+
+        poolFor(0, num_chunks, radixScatter, (void*)&ri);
+        int* tmp = ri.src;
+        ri.src = ri.dst;
+        ri.dst = tmp;
+    }
+    if(ri.src != arr)
+        memcpy(arr, ri.src, sizeof(int) * n);
+    free(ri.counts);
+}
+
+
+// ------------------- SAMPLE SORT IMPLEMENTATION -------------------
+// splitters are picked from an oversampled, sorted sample. One parallel pass counts the bucket sizes of every
+// chunk, one scatters every chunk into its buckets, and the buckets are then sorted independently by the sequential
+// mergesort: a single exchange of the data instead of one synchronized merge round per level of the recursion
+void buildSplitterTree(int* tree, const int* splitters, int j, int lo, int hi)
+{
+    if(lo > hi)
+        return;
+    int mid = lo + (hi-lo)/2;
+    tree[j] = splitters[mid];
+    buildSplitterTree(tree, splitters, 2*j, lo, mid-1);
+    buildSplitterTree(tree, splitters, 2*j+1, mid+1, hi);
+}
+
+int sampleBucket(const sampleInfo* si, int x)
+{
+    // the tree is descended without branches (the comparison result is the index of the child), then elements
+    // equal to a splitter get a bucket of their own, so heavy duplicates do not unbalance the buckets
+    int j = 1;
+    for(int l=0; l<si->levels; l++)
+        j = 2*j + (x > si->tree[j]);
+    int b = j - (si->num_splitters + 1); // number of splitters smaller than x
+    return 2*b + ((b < si->num_splitters) & (si->splitters[b] == x));
+}
+
+void sampleHistogram(void* input, int c)
+{
+    sampleInfo* si = (sampleInfo*)input;
+    int* count = si->counts + (size_t)c * si->num_buckets;
+    int lo = (int)((long long)si->n * c / si->num_chunks), hi = (int)((long long)si->n * (c+1) / si->num_chunks);
+    for(int b=0; b<si->num_buckets; b++)
+        count[b] = 0;
+    for(int i=lo; i<hi; i++)
+        count[sampleBucket(si, si->src[i])]++;
+}
+
+void sampleScatter(void* input, int c)
+{
+    sampleInfo* si = (sampleInfo*)input;
+    int* offset = si->counts + (size_t)c * si->num_buckets;
+    int lo = (int)((long long)si->n * c / si->num_chunks), hi = (int)((long long)si->n * (c+1) / si->num_chunks);
+    for(int i=lo; i<hi; i++)
+        si->dst[offset[sampleBucket(si, si->src[i])]++] = si->src[i];
+}
+
+void sampleSortBucket(void* input, int b)
+{
+    // sorts bucket b from dst back into src, buckets of elements equal to a splitter are only copied
+    sampleInfo* si = (sampleInfo*)input;
+    int lo = si->bucket_starts[b], hi = si->bucket_starts[b+1];
+    if(b % 2 == 1)
+        memcpy(si->src+lo, si->dst+lo, sizeof(int) * (hi-lo));
+    else if(hi > lo)
+        mergeSortTo(si->dst, si->src, lo, hi-1, 1);
+}
+
+void sampleSort(int* arr, int* buf, int n)
+{
+    // sorts arr[0..n-1] using buf as scratch space
+    int num_workers = sort_pool->num_workers > 0 ? sort_pool->num_workers : 1;
+    if(n < 2)
+        return;
+    sampleInfo si = {arr, buf, n, num_workers, 1, 1, NULL, NULL, 0, NULL, NULL};
+    if(n < num_workers * SEQUENTIAL_CUTOFF)
+        si.num_chunks = 1;
+    while(si.num_splitters+1 < SAMPLE_BUCKETS_PER_WORKER * num_workers)
+    {
+        si.num_splitters = 2*si.num_splitters + 1;
+        si.levels++;
+    }
+    si.num_buckets = 2 * si.num_splitters + 1;
+
+    // sample at evenly spaced positions, jittered by a fixed LCG so that periodic input is not sampled in phase
+    int num_samples = (si.num_splitters + 1) * SAMPLE_OVERSAMPLING;
+    int* samples = malloc(sizeof(int) * num_samples);
+    unsigned state = 12345;
+    for(int i=0; i<num_samples; i++)
+    {
+        state = state * 1103515245u + 12345u;
+        long long pos = (long long)n * i / num_samples + (long long)(state >> 8) % ((n / num_samples) + 1);
+        samples[i] = arr[pos < n ? pos : n-1];
+    }
+    normalMergeSort(samples, 0, num_samples-1);
+    si.splitters = malloc(sizeof(int) * (si.num_splitters + 1)); // one spare element read by sampleBucket
+    si.tree = malloc(sizeof(int) * (si.num_splitters + 1));
+    for(int i=0; i<si.num_splitters; i++)
+        si.splitters[i] = samples[(i+1) * SAMPLE_OVERSAMPLING];
+    si.splitters[si.num_splitters] = 0;
+    buildSplitterTree(si.tree, si.splitters, 1, 0, si.num_splitters-1);
+    free(samples);
+
+    si.counts = malloc(sizeof(int) * si.num_chunks * si.num_buckets);
+    si.bucket_starts = malloc(sizeof(int) * (si.num_buckets + 1));
+    poolFor(0, si.num_chunks, sampleHistogram, (void*)&si);
+
+    // exclusive prefix sum over (bucket, chunk)
+    int total = 0;
+    for(int b=0; b<si.num_buckets; b++)
+    {
+        si.bucket_starts[b] = total;
+        for(int c=0; c<si.num_chunks; c++)
+        {
+            int count = si.counts[(size_t)c * si.num_buckets + b];
+            si.counts[(size_t)c * si.num_buckets + b] = total;
+            total += count;
+        }
+    }
+    si.bucket_starts[si.num_buckets] = n;
+
+    poolFor(0, si.num_chunks, sampleScatter, (void*)&si);
+    poolFor(0, si.num_buckets, sampleSortBucket, (void*)&si);
+    free(si.splitters);
+    free(si.tree);
+    free(si.counts);
+    free(si.bucket_starts);
+}
+
+
+// ------------------- SELECTION AND PARTIAL SORT -------------------
+// parallel quickselect: every round partitions the part of the array that holds the k-th element three ways around
+// a pivot (count, prefix sum and scatter in parallel, as in radix sort) and keeps only the part that holds k.
+// The pivot is taken from a sorted sample at the rank of k, so each round shrinks the part by much more than half
+void sequentialSelect(int* arr, int* buf, int lb, int ub, int k)
+{
+    // introselect: quickselect with median of three pivots, falling back to mergesort when it does not converge
+    int depth_limit = 2;
+    for(int len=ub-lb+1; len>1; len/=2)
+        depth_limit += 2;
+    while(ub-lb+1 > SMALL_SORT_SIZE)
+    {
+        if(depth_limit-- == 0)
+        {
+            mergeSortTo(arr, buf, lb, ub, 0);
+            return;
+        }
+        int mid = lb + (ub-lb)/2;
+        int a = arr[lb], b = arr[mid], c = arr[ub];
+        int pivot = (a < b) ? ((b < c) ? b : (a < c) ? c : a) : ((a < c) ? a : (b < c) ? c : b);
+        int i = lb, j = ub;
+        while(i <= j)
+        {
+            while(arr[i] < pivot)
+                i++;
+            while(arr[j] > pivot)
+                j--;
+            if(i <= j)
+            {
+                int t = arr[i];
+                arr[i++] = arr[j];
+                arr[j--] = t;
+            }
+        }
+        // arr[lb..j] <= pivot <= arr[i..ub], and elements between j and i equal pivot
+        if(k <= j)
+            ub = j;
+        else if(k >= i)
+            lb = i;
+        else
+            return;
+    }
+    insertionSort(arr, lb, ub);
+}
+
+void selectCount(void* input, int c)
+{
+    selectInfo* si = (selectInfo*)input;
+    int* count = si->counts + 3*c;
+    int len = si->hi - si->lo;
+    int lo = si->lo + (int)((long long)len * c / si->num_chunks), hi = si->lo + (int)((long long)len * (c+1) / si->num_chunks);
+    count[0] = count[1] = count[2] = 0;
+    for(int i=lo; i<hi; i++)
+        count[(si->arr[i] >= si->pivot) + (si->arr[i] > si->pivot)]++;
+}
+
+void selectScatter(void* input, int c)
+{
+    selectInfo* si = (selectInfo*)input;
+    int* offset = si->counts + 3*c;
+    int len = si->hi - si->lo;
+    int lo = si->lo + (int)((long long)len * c / si->num_chunks), hi = si->lo + (int)((long long)len * (c+1) / si->num_chunks);
+    for(int i=lo; i<hi; i++)
+        si->buf[offset[(si->arr[i] >= si->pivot) + (si->arr[i] > si->pivot)]++] = si->arr[i];
+}
+
+void selectCopyBack(void* input, int c)
+{
+    selectInfo* si = (selectInfo*)input;
+    int len = si->hi - si->lo;
+    int lo = si->lo + (int)((long long)len * c / si->num_chunks), hi = si->lo + (int)((long long)len * (c+1) / si->num_chunks);
+    memcpy(si->arr+lo, si->buf+lo, sizeof(int) * (hi-lo));
+}
+
+void nthElement(int* arr, int* buf, int n, int k)
+{
+    // rearranges arr[0..n-1] (buf as scratch space) so that arr[k] is the element a full sort would put there,
+    // with no larger element before it and no smaller element after it
+    if(k < 0 || k >= n)
+        return;
+    int num_workers = sort_pool->num_workers > 0 ? sort_pool->num_workers : 1;
+    selectInfo si = {arr, buf, 0, n, num_workers, 0, malloc(sizeof(int) * 3 * num_workers)};
+    unsigned state = 12345;
+    for(int round=0; round<MAX_SELECT_ROUNDS && si.hi - si.lo > num_workers * SEQUENTIAL_CUTOFF; round++)
+    {
+        int len = si.hi - si.lo, sample[SELECT_SAMPLE_SIZE];
+        for(int i=0; i<SELECT_SAMPLE_SIZE; i++)
+        {
+            state = state * 1103515245u + 12345u;
+            sample[i] = arr[si.lo + (int)((state >> 4) % (unsigned)len)];
+        }
+        insertionSort(sample, 0, SELECT_SAMPLE_SIZE-1);
+        si.pivot = sample[(int)((long long)(k - si.lo) * SELECT_SAMPLE_SIZE / len)];
+
+        poolFor(0, num_workers, selectCount, (void*)&si);
+        int total[3] = {0, 0, 0}, offset = si.lo;
+        for(int part=0; part<3; part++)
+        {
+            for(int c=0; c<num_workers; c++)
+            {
+                int count = si.counts[3*c + part];
+                si.counts[3*c + part] = offset;
+                offset += count;
+                total[part] += count;
+            }
+        }
+        poolFor(0, num_workers, selectScatter, (void*)&si);
+        poolFor(0, num_workers, selectCopyBack, (void*)&si);
+
+        if(k < si.lo + total[0])
+            si.hi = si.lo + total[0];
+        else if(k < si.lo + total[0] + total[1])
+            si.hi = si.lo; // arr[k] equals the pivot
+        else
+            si.lo += total[0] + total[1];
+    }
+    if(si.hi > si.lo)
+        sequentialSelect(arr, buf, si.lo, si.hi-1, k);
+    free(si.counts);
+}
+
+void partialSort(int* arr, int* buf, int n, int k)
+{
+    // sorts the k smallest elements of arr[0..n-1] into arr[0..k-1] in O(n + k log k)
+    if(k > n)
+        k = n;
+    if(k <= 0)
+        return;
+    if(k < n)
+        nthElement(arr, buf, n, k-1);
+    if(k > SEQUENTIAL_CUTOFF)
+    {
+        arrayInfo ai = {0, k-1, arr, buf, 0};
+        poolRun(sort_pool, threadedMergeSort, (void*)(&ai));
+    }
+    else
+        mergeSortTo(arr, buf, 0, k-1, 0);
+}
+
+
+// ------------------- ADAPTIVE MERGESORT IMPLEMENTATION -------------------
+// Timsort-style natural mergesort: the array is cut into ascending runs (strictly descending runs are reversed,
+// short runs are extended to leaf_cutoff elements by leafSort) by all workers in parallel, and the runs are
+// merged pairwise in a balanced tree of pool tasks with galloping merges, so presorted input costs about one pass
+int gallopUpper(const int* a, int len, int key)
+{
+    // number of leading elements of a that are <= key, found by exponential then binary search
+    int lo = 0, hi = 1;
+    while(hi < len && a[hi-1] <= key)
+    {
+        lo = hi;
+        hi = 2*hi + 1;
+    }
+    if(hi > len)
+        hi = len;
+    while(lo < hi)
+    {
+        int mid = lo + (hi-lo)/2;
+        if(a[mid] <= key)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int gallopLower(const int* a, int len, int key)
+{
+    // number of leading elements of a that are < key
+    int lo = 0, hi = 1;
+    while(hi < len && a[hi-1] < key)
+    {
+        lo = hi;
+        hi = 2*hi + 1;
+    }
+    if(hi > len)
+        hi = len;
+    while(lo < hi)
+    {
+        int mid = lo + (hi-lo)/2;
+        if(a[mid] < key)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void gallopMerge(int* arr, int* tmp, int lb, int mid, int ub)
+{
+    // stable in-place merge of arr[lb..mid] and arr[mid+1..ub], only the left run is moved to tmp[lb..mid]
+    int i = lb, j = mid+1, k = lb, left_wins = 0, right_wins = 0;
+    memcpy(tmp+lb, arr+lb, sizeof(int) * (mid-lb+1));
+    while(i <= mid && j <= ub)
+    {
+        if(arr[j] < tmp[i])
+        {
+            arr[k++] = arr[j++];
+            right_wins++;
+            left_wins = 0;
+        }
+        else
+        {
+            arr[k++] = tmp[i++];
+            left_wins++;
+            right_wins = 0;
+        }
+        if(left_wins >= MIN_GALLOP && i <= mid && j <= ub)
+        {
+            // the left run keeps winning: copy every element up to the next right element at once
+            int count = gallopUpper(tmp+i, mid-i+1, arr[j]);
+            memcpy(arr+k, tmp+i, sizeof(int) * count);
+            i += count, k += count, left_wins = 0;
+        }
+        else if(right_wins >= MIN_GALLOP && i <= mid && j <= ub)
+        {
+            int count = gallopLower(arr+j, ub-j+1, tmp[i]);
+            memmove(arr+k, arr+j, sizeof(int) * count);
+            j += count, k += count, right_wins = 0;
+        }
+    }
+    memcpy(arr+k, tmp+i, sizeof(int) * (mid-i+1)); // the rest of the right run is already in place
+}
+
+void findRuns(void* input, int c)
+{
+    runInfo* ri = (runInfo*)input;
+    int* arr = ri->arr;
+    int* runs = ri->chunk_runs + (size_t)c * ri->max_runs;
+    int lo = (int)((long long)ri->n * c / ri->num_chunks), hi = (int)((long long)ri->n * (c+1) / ri->num_chunks);
+    int num_runs = 0, i = lo;
+    while(i < hi)
+    {
+        int j = i+1;
+        if(j < hi && arr[j] < arr[i])
+        {
+            while(j+1 < hi && arr[j+1] < arr[j])
+                j++;
+            for(int x=i, y=j; x<y; x++, y--)
+            {
+                int t = arr[x];
+                arr[x] = arr[y];
+                arr[y] = t;
+            }
+            j++;
+        }
+        else
+            while(j < hi && arr[j] >= arr[j-1])
+                j++;
+        if(j-i < leaf_cutoff && j < hi)
+        {
+            j = (i+leaf_cutoff < hi) ? i+leaf_cutoff : hi;
+            leafSort(arr+i, ri->buf+i, j-i, 0);
+        }
+        runs[num_runs++] = i;
+        i = j;
+    }
+    ri->num_chunk_runs[c] = num_runs;
+}
+
+void* mergeRunRange(void* input)
+{
+    // merges runs lo..hi-1 into one sorted segment of arr
+    runInfo* ri = (runInfo*)input;
+    if(ri->hi - ri->lo < 2)
+        return NULL;
+    int lb = ri->runs[ri->lo], ub = ri->runs[ri->hi] - 1;
+
+    // split at the first run boundary past the middle element, so both halves hold about the same number of elements
+    int split = ri->lo+1 + gallopLower(ri->runs + ri->lo+1, ri->hi - ri->lo - 1, lb + (ub-lb+1)/2);
+    if(split == ri->hi)
+        split--;
+    runInfo ri1 = *ri, ri2 = *ri;
+    ri1.hi = split;
+    ri2.lo = split;
+    if(ub-lb+1 > SEQUENTIAL_CUTOFF)
+    {
+        task left;
+        poolSpawn(sort_pool, &left, mergeRunRange, (void*)(&ri1));
+        mergeRunRange((void*)(&ri2));
+        poolSync(sort_pool, &left);
+    }
+    else
+    {
+        mergeRunRange((void*)(&ri1));
+        mergeRunRange((void*)(&ri2));
+    }
+
+    // elements of the left run that are <= the first right element, and elements of the right run that are >=
+    // the last left element, are already in place (all of them on presorted input)
+    int* arr = ri->arr;
+    int mid = ri->runs[split] - 1;
+    lb += gallopUpper(arr+lb, mid-lb+1, arr[mid+1]);
+    if(lb > mid)
+        return NULL;
+    ub = mid + gallopLower(arr+mid+1, ub-mid, arr[mid]);
+    int len1 = mid-lb+1, len2 = ub-mid;
+    if(len1 > MIN_GALLOP * len2 || len2 > MIN_GALLOP * len1)
+        gallopMerge(arr, ri->buf, lb, mid, ub); // lopsided merges mostly gallop over the longer run
+    else
+    {
+        // interleaved runs of similar length merge faster with the branch-free kernel
+        memcpy(ri->buf+lb, arr+lb, sizeof(int) * (ub-lb+1));
+        mergeInfo mi = {ri->buf, arr, lb, mid, ub, lb, ub};
+        if(ub-lb+1 > PARALLEL_MERGE_THRESHOLD)
+            parallelMerge((void*)(&mi));
+        else
+            merge(mi.src, mi.dst, lb, mid, ub);
+    }
+    return NULL;
+}
+
+void adaptiveMergeSort(int* arr, int* buf, int n)
+{
+    // sorts arr[0..n-1] using buf as scratch space, in time close to linear when arr is nearly sorted
+    int num_chunks = sort_pool->num_workers > 0 ? 4 * sort_pool->num_workers : 1;
+    if(n < num_chunks * SEQUENTIAL_CUTOFF)
+        num_chunks = 1;
+    runInfo ri = {arr, buf, n, num_chunks, 0, NULL, NULL, NULL, 0, 0};
+    ri.max_runs = n / num_chunks / leaf_cutoff + 2;
+    ri.chunk_runs = malloc(sizeof(int) * ((size_t)ri.max_runs * num_chunks + 1));
+    ri.num_chunk_runs = malloc(sizeof(int) * num_chunks);
+    poolFor(0, num_chunks, findRuns, (void*)&ri);
 
-// ------------------- GLOBAL VARIABLES -------------------
-int shm_id;
+    ri.runs = ri.chunk_runs; // compacted in place, chunk c's runs never move forward past its own slot
+    for(int c=0; c<num_chunks; c++)
+        for(int r=0; r<ri.num_chunk_runs[c]; r++)
+            ri.runs[ri.hi++] = ri.chunk_runs[(size_t)c * ri.max_runs + r];
+    ri.runs[ri.hi] = n;
+    if(ri.hi > 1)
+        poolRun(sort_pool, mergeRunRange, (void*)&ri);
+    free(ri.chunk_runs);
+    free(ri.num_chunk_runs);
+}
 
 
-// ------------------- HELPER FUNCTIONS -------------------
-int * shareMem(size_t size){
-    key_t mem_key = IPC_PRIVATE;
-    shm_id = shmget(mem_key, size, IPC_CREAT | 0666);
-    return (int*)shmat(shm_id, NULL, 0);
+// ------------------- NUMA-AWARE MERGESORT IMPLEMENTATION -------------------
+// the array is cut into one partition per (pinned) worker. Every worker first-touches its partition of arr and buf,
+// so the pages are placed on its node, and sorts it. At every merge level each worker then co-ranks and writes
+// exactly its own partition of the output, so all writes and most reads stay on the worker's node
+int numaPartStart(const numaInfo* ni, int w)
+{
+    return (int)((long long)ni->n * w / ni->num_parts);
 }
 
-void printArray(const int* arr, int n)
+void numaTouchPart(void* input, int w)
 {
-    for(int i=0; i<n; i++)
-        printf("%d ", arr[i]);
-    printf("\n");
+    numaInfo* ni = (numaInfo*)input;
+    int lo = numaPartStart(ni, w), hi = numaPartStart(ni, w+1);
+    memset(ni->arr+lo, 0, sizeof(int) * (hi-lo));
+    if(ni->buf != NULL)
+        memset(ni->buf+lo, 0, sizeof(int) * (hi-lo));
 }
 
-long double getTime(struct timespec ts)
+void numaFirstTouch(int* arr, int* buf, int n)
 {
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-    return ts.tv_nsec/(1e9) + ts.tv_sec;
+    // fault in the pages of freshly allocated arr and buf (may be NULL) from the worker that sorts each partition
+    numaInfo ni = {arr, buf, NULL, NULL, n, sort_pool->num_workers > 0 ? sort_pool->num_workers : 1, 0, 0};
+    poolForEachWorker(numaTouchPart, (void*)&ni);
+}
+
+void numaSortPart(void* input, int w)
+{
+    numaInfo* ni = (numaInfo*)input;
+    mergeSortTo(ni->arr, ni->buf, numaPartStart(ni, w), numaPartStart(ni, w+1) - 1, ni->to_buf);
 }
 
+void numaMergePart(void* input, int w)
+{
+    // worker w produces its own partition of the merge of the two runs of its group
+    numaInfo* ni = (numaInfo*)input;
+    int group = w / (2*ni->width) * (2*ni->width);
+    int mid = (group + ni->width < ni->num_parts) ? group + ni->width : ni->num_parts;
+    int end = (group + 2*ni->width < ni->num_parts) ? group + 2*ni->width : ni->num_parts;
+    mergeSlice(ni->src, ni->dst, numaPartStart(ni, group), numaPartStart(ni, mid) - 1, numaPartStart(ni, end) - 1,
+               numaPartStart(ni, w), numaPartStart(ni, w+1) - 1);
+}
+
+void numaMergeSort(int* arr, int* buf, int n)
+{
+    // sorts arr[0..n-1] using buf as scratch space, both should have been first-touched by numaFirstTouch
+    int num_parts = sort_pool->num_workers > 0 ? sort_pool->num_workers : 1, levels = 0;
+    while((1 << levels) < num_parts)
+        levels++;
+    // partitions are sorted into whichever array makes the last merge level end in arr
+    numaInfo ni = {arr, buf, NULL, NULL, n, num_parts, 0, levels % 2};
+    poolForEachWorker(numaSortPart, (void*)&ni);
+
+    ni.src = ni.to_buf ? buf : arr;
+    ni.dst = ni.to_buf ? arr : buf;
+    for(ni.width=1; ni.width<num_parts; ni.width*=2)
+    {
+        poolForEachWorker(numaMergePart, (void*)&ni);
+        int* tmp = (int*)ni.src;
+        ni.src = ni.dst;
+        ni.dst = tmp;
+    }
+}
+
+
+// ------------------- BATCHED SORT -------------------
+// many independent arrays are sorted by one pool submission: consecutive small segments are packed into work items of
+// about SEQUENTIAL_CUTOFF elements that one worker sorts back to back, large segments are split by threadedMergeSort
+void sortBatchItem(void* input, int item)
+{
+    batchInfo* bi = (batchInfo*)input;
+    int first = bi->item_starts[item], last = bi->item_starts[item+1] - 1;
+    if(first == last && bi->segments[first].n > SEQUENTIAL_CUTOFF)
+    {
+        int n = bi->segments[first].n;
+        int* buf = malloc(sizeof(int) * n);
+        if(buf == NULL)
+        {
+            fprintf(stderr, RED "Failed to allocate merge buffer\n" RESET);
+            exit(1);
+        }
+        arrayInfo ai = {0, n-1, bi->segments[first].data, buf, 0};
+        threadedMergeSort((void*)(&ai)); // spawns its halves on this worker's deque
+        free(buf);
+        return;
+    }
+    int buf[SEQUENTIAL_CUTOFF];
+    for(int s=first; s<=last; s++)
+        if(bi->segments[s].n > 1)
+            mergeSortTo(bi->segments[s].data, buf, 0, bi->segments[s].n - 1, 0);
+}
 
-// ------------------- SELECTION SORT IMPLEMENTATION -------------------
-void selectionSort(int* arr, int lb, int ub)
+void sortBatch(sortSegment* segments, int num_segments)
 {
-    int min, pos;
-    for(int i=lb; i<=ub-1; i++)
+    // sorts every segments[i].data[0..n-1] on sort_pool, returns when all of them are sorted
+    batchInfo bi = {segments, malloc(sizeof(int) * (num_segments + 1))};
+    int num_items = 0, packed = 0;
+    for(int s=0; s<num_segments; s++)
     {
-        min = arr[i], pos = i;
-        for(int j=i+1; j<=ub; j++)
+        if(segments[s].n > SEQUENTIAL_CUTOFF || packed + segments[s].n > SEQUENTIAL_CUTOFF || s == 0)
         {
-            if(arr[j] < min)
-                pos = j, min = arr[j];
+            bi.item_starts[num_items++] = s;
+            packed = 0;
         }
-        arr[pos] = arr[i];
-        arr[i] = min;
+        packed += segments[s].n;
+        if(segments[s].n > SEQUENTIAL_CUTOFF)
+            packed = SEQUENTIAL_CUTOFF + 1; // nothing is packed after a large segment
     }
+    bi.item_starts[num_items] = num_segments;
+    poolFor(0, num_items, sortBatchItem, (void*)&bi);
+    free(bi.item_starts);
 }
 
+void sortInit(int num_workers)
+{
+    // sets up the library for callers with their own main: kernels, the persistent pool and the fork depth
+    if(num_workers < 1)
+        num_workers = (sysconf(_SC_NPROCESSORS_ONLN) > 0) ? (int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    initKernels();
+    sort_pool = poolCreate(num_workers);
+    if(max_fork_depth < 0)
+        for(max_fork_depth = 0; (1 << max_fork_depth) < num_workers; max_fork_depth++);
+}
 
-// ------------------- MERGESORT IMPLEMENTATIONS -------------------
-void merge(int* arr, int lb, int mid, int ub)
+void sortShutdown()
 {
-    int len1 = mid-lb+1, len2 = ub-mid;
-    int arr1[len1], arr2[len2];
-    int i, j, k = lb;
-    for(i=0; i<len1; i++, k++)
-        arr1[i] = arr[k];
-    for(j=0; j<len2; j++, k++)
-        arr2[j] = arr[k];
-    for(i=0, j=0, k=lb; (i<len1 && j<len2); k++)
-    {
-        if(arr1[i] < arr2[j])
-            arr[k] = arr1[i], i++;
-        else
-            arr[k] = arr2[j], j++;
+    poolDestroy(sort_pool);
+    sort_pool = NULL;
+}
+
+
+// ------------------- TYPED MERGESORT IMPLEMENTATIONS -------------------
+// int keeps the hand-written engine above (SIMD kernels, leaf strategies, multi-process sort), every other element
+// type gets its own copy of the generic engine from sort_template.h with the comparison expanded inline
+void sortDataInt32(void* data, int n)
+{
+    parallelMergeSort((int*)data, n);
+}
+
+# define SORT_TYPE int64_t
+# define SORT_SUFFIX Int64
+# include "sort_template.h"
+
+# define SORT_TYPE uint64_t
+# define SORT_SUFFIX UInt64
+# include "sort_template.h"
+
+// NaNs sort after every number
+# define SORT_TYPE float
+# define SORT_SUFFIX Float
+# define SORT_LESS(a, b) (!__builtin_isnan(a) && (__builtin_isnan(b) || (a) < (b)))
+# include "sort_template.h"
+
+# define SORT_TYPE double
+# define SORT_SUFFIX Double
+# define SORT_LESS(a, b) (!__builtin_isnan(a) && (__builtin_isnan(b) || (a) < (b)))
+# include "sort_template.h"
+
+// records are ordered by key only, equal keys keep their input order
+# define SORT_TYPE record
+# define SORT_SUFFIX Record
+# define SORT_LESS(a, b) ((a).key < (b).key)
+# include "sort_template.h"
+
+elementType element_types[] = {
+    {"int32", sizeof(int32_t), sizeof(int32_t), sortDataInt32},
+    {"int64", sizeof(int64_t), sizeof(int64_t), sortDataInt64},
+    {"uint64", sizeof(uint64_t), sizeof(uint64_t), sortDataUInt64},
+    {"float", sizeof(float), sizeof(float), sortDataFloat},
+    {"double", sizeof(double), sizeof(double), sortDataDouble},
+    {"record", sizeof(record), sizeof(uint64_t), sortDataRecord}
+};
+# define NUM_ELEMENT_TYPES (int)(sizeof(element_types) / sizeof(elementType))
+
+
+// ------------------- LEAF CALIBRATION -------------------
+void calibrateLeaf()
+{
+    // time every leaf strategy and cutoff on random data sized so that the array and buffer fit in the L2 cache
+    long cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    int n = (cache_size > 0) ? (int)(cache_size / (2 * sizeof(int))) : 65536;
+    if(n < 65536)
+        n = 65536;
+    int *data = malloc(sizeof(int) * n), *arr = malloc(sizeof(int) * n), *buf = malloc(sizeof(int) * n);
+    for(int i=0; i<n; i++)
+        data[i] = rand();
+
+    struct timespec ts;
+    long double best_time = -1, start_time, t;
+    int best_strategy = 0, best_cutoff = DEFAULT_LEAF_CUTOFF;
+    printf("Calibrating leaf sort on %d elements (L2 cache: %ld bytes)\n", n, cache_size);
+    for(int s=0; s<NUM_LEAF_STRATEGIES; s++)
+    {
+        leafSort = leaf_strategies[s].sort;
+        for(leaf_cutoff=4; leaf_cutoff<=256; leaf_cutoff*=2)
+        {
+            long double min_time = -1;
+            for(int rep=0; rep<5; rep++)
+            {
+                for(int i=0; i<n; i++)
+                    arr[i] = data[i];
+                start_time = getTime(ts);
+                mergeSortTo(arr, buf, 0, n-1, 0);
+                t = getTime(ts) - start_time;
+                if(min_time < 0 || t < min_time)
+                    min_time = t;
+            }
+            printf("%-10s cutoff %-4d %Lf\n", leaf_strategies[s].name, leaf_cutoff, min_time);
+            if(best_time < 0 || min_time < best_time)
+                best_time = min_time, best_strategy = s, best_cutoff = leaf_cutoff;
+        }
     }
-    for(int x=i; x<len1; x++, k++)
-        arr[k] = arr1[x];
-    for(int x=j; x<len2; x++, k++)
-        arr[k] = arr2[x];
+    leafSort = leaf_strategies[best_strategy].sort;
+    leaf_cutoff = best_cutoff;
+    printf(GREEN "Using %s leaf sort with cutoff %d\n\n" RESET, leaf_strategies[best_strategy].name, best_cutoff);
+    free(data);
+    free(arr);
+    free(buf);
 }
 
-void normalMergeSort(int* arr, int lb, int ub)
+
+// ------------------- BINARY FILE SORT -------------------
+void swapKeys(void* data, int n, const elementType* type)
 {
-    if(ub-lb >= 5)
+    // converts the leading key_size bytes of every element between little-endian and the host byte order
+    for(int i=0; i<n; i++)
     {
-        int mid = lb + (ub-lb)/2;
-        normalMergeSort(arr, lb, mid);
-        normalMergeSort(arr, mid+1, ub);
-        merge(arr, lb, mid, ub);
+        char* e = (char*)data + (size_t)i * type->size;
+        if(type->key_size == 4)
+            *(uint32_t*)e = __builtin_bswap32(*(uint32_t*)e);
+        else
+            *(uint64_t*)e = __builtin_bswap64(*(uint64_t*)e);
     }
-    else
-        selectionSort(arr, lb, ub);
 }
 
-void concurrentMergeSort(int* arr, int lb, int ub)
+void sortFile(const char* input_file, const char* output_file, const elementType* type)
 {
-    if(ub-lb >= 5)
+    int elem_size = type->size;
+    // the file is mapped straight into memory and sorted there, without parsing or formatting any text
+    struct timespec ts;
+    long double start_time, t_io, t_sort;
+    start_time = getTime(ts);
+
+    int in_fd = open(input_file, output_file ? O_RDONLY : O_RDWR);
+    if(in_fd == -1)
     {
-        int mid = lb + (ub-lb)/2;
-        int pid1, pid2;
-        pid1 = fork();
-        if(pid1 == -1)
+        perror(input_file);
+        exit(1);
+    }
+    struct stat st;
+    fstat(in_fd, &st);
+    if(st.st_size % elem_size != 0)
+    {
+        fprintf(stderr, RED "%s is not a whole number of %d-byte elements: %lld stray byte(s) at the end\n" RESET,
+                input_file, elem_size, (long long)(st.st_size % elem_size));
+        exit(1);
+    }
+    if(st.st_size / elem_size > INT_MAX)
+    {
+        fprintf(stderr, RED "%s must hold at most %d elements of %d bytes\n" RESET, input_file, INT_MAX, elem_size);
+        exit(1);
+    }
+    int n = (int)(st.st_size / elem_size);
+    if(n == 0)
+    {
+        printf("%s is empty\n", input_file);
+        close(in_fd);
+        return;
+    }
+
+    // sort in place through a shared mapping of the input, or of the output after copying the input into it
+    void* data;
+    if(output_file == NULL)
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, in_fd, 0);
+    else
+    {
+        int out_fd = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if(out_fd == -1 || ftruncate(out_fd, st.st_size) == -1)
         {
-            fprintf(stderr, RED "Failed to fork child process: defaulting to normal merge sort\n" RESET);
-            normalMergeSort(arr, lb, ub);
+            perror(output_file);
             exit(1);
         }
-        if(pid1 == 0)
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+        void* in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if(data == MAP_FAILED || in == MAP_FAILED)
         {
-            concurrentMergeSort(arr, lb, mid);
+            perror("mmap");
             exit(1);
         }
-        else
+        madvise(in, st.st_size, MADV_SEQUENTIAL);
+        memcpy(data, in, st.st_size);
+        munmap(in, st.st_size);
+        close(out_fd);
+    }
+    if(data == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(data, st.st_size, MADV_WILLNEED);
+    t_io = getTime(ts) - start_time;
+
+    // elements are stored little-endian
+    start_time = getTime(ts);
+# if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    swapKeys(data, n, type);
+# endif
+    type->sort(data, n);
+# if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    swapKeys(data, n, type);
+# endif
+    t_sort = getTime(ts) - start_time;
+
+    munmap(data, st.st_size);
+    close(in_fd);
+    printf("Sorted %d %s elements from %s into %s\n", n, type->name, input_file, output_file ? output_file : input_file);
+    printf(GREEN "Time taken to map the input = %Lf\n" RESET, t_io);
+    printf(GREEN "Time taken by multi-threaded mergesort = %Lf\n" RESET, t_sort);
+}
+
+
+// ------------------- EXTERNAL MERGESORT -------------------
+// files larger than the memory budget are sorted in two phases:
+// 1. runs that fit in memory are read, sorted on the thread pool and spilled to a temporary file
+// 2. all runs are merged in one pass through a loser tree, with every block read and written by a background I/O thread
+void* ioThread(void* input)
+{
+    ioQueue* q = (ioQueue*)input;
+    while(1)
+    {
+        pthread_mutex_lock(&q->mutex);
+        while(q->head == NULL && q->shutdown == 0)
+            pthread_cond_wait(&q->submitted, &q->mutex); // wait for a request
+        if(q->head == NULL)
         {
-            pid2 = fork();
-            if(pid2 == -1)
-            {
-                fprintf(stderr, RED "Failed to fork child process: defaulting to normal merge sort\n" RESET);
-                normalMergeSort(arr, mid+1, ub);
-                waitpid(pid1, NULL, 0);
-                merge(arr, lb, mid, ub);
-                exit(1);
-            }
-            if(pid2 == 0)
-            {
-                concurrentMergeSort(arr, mid+1, ub);
-                exit(1);
-            }
+            pthread_mutex_unlock(&q->mutex);
+            break;
+        }
+        ioRequest* req = q->head;
+        q->head = req->next;
+        if(q->head == NULL)
+            q->tail = NULL;
+        pthread_mutex_unlock(&q->mutex);
+
+        size_t done = 0;
+        ssize_t r = 0;
+        while(done < req->size)
+        {
+            if(req->is_write)
+                r = pwrite(req->fd, (char*)req->data + done, req->size - done, req->offset + done);
             else
-            {
-                waitpid(pid1, NULL, 0);
-                waitpid(pid2, NULL, 0);
-                merge(arr, lb, mid, ub);
-            }
+                r = pread(req->fd, (char*)req->data + done, req->size - done, req->offset + done);
+            if(r <= 0)
+                break;
+            done += r;
         }
+        if(r < 0)
+            perror(req->is_write ? "pwrite" : "pread");
+
+        pthread_mutex_lock(&q->mutex);
+        req->result = done;
+        req->done = 1;
+        pthread_cond_broadcast(&q->completed); // signal that a request has completed
+        pthread_mutex_unlock(&q->mutex);
     }
+    return NULL;
+}
+
+void ioSubmit(ioQueue* q, ioRequest* req, int fd, int is_write, void* data, size_t size, off_t offset)
+{
+    req->fd = fd;
+    req->is_write = is_write;
+    req->data = data;
+    req->size = size;
+    req->offset = offset;
+    req->done = 0;
+    req->next = NULL;
+    pthread_mutex_lock(&q->mutex);
+    if(q->tail != NULL)
+        q->tail->next = req;
     else
-        selectionSort(arr, lb, ub);
+        q->head = req;
+    q->tail = req;
+    pthread_cond_signal(&q->submitted);
+    pthread_mutex_unlock(&q->mutex);
 }
 
-void* threadedMergeSort(void* input)
+size_t ioWait(ioQueue* q, ioRequest* req)
 {
-    arrayInfo* ai = (arrayInfo*)input;
-    int lb = ai->lb;
-    int ub = ai->ub;
-    int* arr = ai->arr;
+    pthread_mutex_lock(&q->mutex);
+    while(req->done == 0)
+        pthread_cond_wait(&q->completed, &q->mutex);
+    pthread_mutex_unlock(&q->mutex);
+    return req->result;
+}
 
-    if(ub-lb >= 5)
-    {
-        int mid = lb + (ub-lb)/2;
-        pthread_t tid1, tid2;
-        arrayInfo ai1 = {lb, mid, arr};
-        arrayInfo ai2 = {mid+1, ub, arr};
+void readerPrefetch(ioQueue* q, runReader* r)
+{
+    // start filling the buffer that is not being consumed with the next block of the run
+    size_t size = (r->end - r->next_offset < (off_t)r->buf_size) ? (size_t)(r->end - r->next_offset) : r->buf_size;
+    ioSubmit(q, &r->req, r->fd, 0, r->bufs[!r->cur], size, r->next_offset);
+    r->next_offset += size;
+}
+
+int readerAdvance(ioQueue* q, runReader* r)
+{
+    // switch to the prefetched block, returns 0 when the run is exhausted
+    size_t bytes = ioWait(q, &r->req);
+    if(bytes == 0)
+        return 0;
+    r->cur = !r->cur;
+    r->len = bytes / sizeof(int);
+    r->pos = 0;
+    readerPrefetch(q, r);
+    return 1;
+}
 
-        if(pthread_create(&tid1, NULL, threadedMergeSort, (void*)(&ai1)) != 0)
+void loserTreeAdjust(int* tree, const long long* keys, int k, int s)
+{
+    // replay the matches from leaf s to the root after its key changed, losers stay in the internal nodes
+    for(int t=(s+k)/2; t>0; t/=2)
+    {
+        if(keys[s] > keys[tree[t]])
         {
-            fprintf(stderr, RED "Failed to create child thread: defaulting to normal merge sort\n" RESET);
-            normalMergeSort(arr, lb, ub);
-            return NULL;
+            int winner = tree[t];
+            tree[t] = s;
+            s = winner;
         }
-        if(pthread_create(&tid2, NULL, threadedMergeSort, (void*)(&ai2)) != 0)
+    }
+    tree[0] = s;
+}
+
+void externalMergeSort(const char* input_file, const char* output_file, const char* temp_dir, size_t memory)
+{
+    struct timespec ts;
+    long double start_time, t_runs, t_merge;
+    int in_fd = open(input_file, O_RDONLY);
+    if(in_fd == -1)
+    {
+        perror(input_file);
+        exit(1);
+    }
+    struct stat st;
+    fstat(in_fd, &st);
+    if(st.st_size % sizeof(int) != 0)
+    {
+        fprintf(stderr, RED "%s is not a whole number of %d-byte elements: %lld stray byte(s) at the end\n" RESET,
+                input_file, (int)sizeof(int), (long long)(st.st_size % sizeof(int)));
+        exit(1);
+    }
+
+    // the number of runs follows from the file size, so a budget too small to merge them fails before phase 1
+    size_t run_elems = memory / (3 * sizeof(int));
+    if(run_elems > INT_MAX)
+        run_elems = INT_MAX;
+    long long total_elems = st.st_size / sizeof(int);
+    int k = (int)((total_elems + run_elems - 1) / run_elems);
+    size_t out_size = (memory / 8) / sizeof(int) * sizeof(int);
+    size_t block_size = (k > 0) ? (memory - 2 * out_size) / (2 * (size_t)k) / sizeof(int) * sizeof(int) : 0;
+    if(k > 0 && block_size < MIN_EXTERNAL_BLOCK)
+    {
+        fprintf(stderr, RED "%d runs do not fit in the memory budget: increase --memory\n" RESET, k);
+        exit(1);
+    }
+
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(out_fd == -1)
+    {
+        perror(output_file);
+        exit(1);
+    }
+    char temp_file[4096];
+    snprintf(temp_file, sizeof(temp_file), "%s/mergesort_runs_XXXXXX", temp_dir);
+    int run_fd = mkstemp(temp_file);
+    if(run_fd == -1)
+    {
+        perror(temp_file);
+        exit(1);
+    }
+    unlink(temp_file); // removed automatically once closed
+
+    ioQueue q = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    pthread_create(&q.thread, NULL, ioThread, (void*)&q);
+
+    // phase 1: the next run is read while the current one is sorted, the sorted run is written while the next
+    // one is sorted (budget: two run buffers and one merge buffer)
+    start_time = getTime(ts);
+    int *cur = malloc(run_elems * sizeof(int)), *next = malloc(run_elems * sizeof(int)), *buf = malloc(run_elems * sizeof(int));
+    if(cur == NULL || next == NULL || buf == NULL)
+    {
+        fprintf(stderr, RED "Failed to allocate %zu bytes for the external sort\n" RESET, memory);
+        exit(1);
+    }
+    off_t* run_offsets = malloc(sizeof(off_t));
+    int num_runs = 0;
+    off_t in_offset = 0, run_offset = 0;
+    ioRequest read_req, write_req;
+    write_req.done = 1;
+    write_req.result = 0;
+
+    ioSubmit(&q, &read_req, in_fd, 0, cur, run_elems * sizeof(int), in_offset);
+    size_t bytes = ioWait(&q, &read_req);
+    in_offset += bytes;
+    while(bytes > 0)
+    {
+        int n = bytes / sizeof(int);
+        ioWait(&q, &write_req); // next is free once the previous run has been written
+        ioSubmit(&q, &read_req, in_fd, 0, next, run_elems * sizeof(int), in_offset);
+
+        arrayInfo ai = {0, n-1, cur, buf, 0};
+        poolRun(sort_pool, threadedMergeSort, (void*)(&ai));
+
+        run_offsets = realloc(run_offsets, sizeof(off_t) * (num_runs + 2));
+        run_offsets[num_runs++] = run_offset;
+        ioSubmit(&q, &write_req, run_fd, 1, cur, n * sizeof(int), run_offset);
+        run_offset += n * sizeof(int);
+
+        bytes = ioWait(&q, &read_req);
+        in_offset += bytes;
+        int* tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    ioWait(&q, &write_req);
+    run_offsets[num_runs] = run_offset;
+    free(cur);
+    free(next);
+    free(buf);
+    t_runs = getTime(ts) - start_time;
+
+    // phase 2: k-way merge, budget split between 2 output blocks and 2 prefetch blocks per run
+    start_time = getTime(ts);
+    k = num_runs; // the same as computed up front unless the file changed while it was read
+
+    runReader* readers = malloc(sizeof(runReader) * (k > 0 ? k : 1));
+    long long* keys = malloc(sizeof(long long) * (k + 1));
+    int* tree = malloc(sizeof(int) * (k > 0 ? k : 1));
+    for(int i=0; i<k; i++)
+    {
+        runReader* r = &readers[i];
+        r->fd = run_fd;
+        r->next_offset = run_offsets[i];
+        r->end = run_offsets[i+1];
+        r->buf_size = block_size;
+        r->bufs[0] = malloc(block_size);
+        r->bufs[1] = malloc(block_size);
+        r->cur = 1;
+        r->pos = r->len = 0;
+        readerPrefetch(&q, r);
+    }
+    for(int i=0; i<k; i++)
+    {
+        keys[i] = readerAdvance(&q, &readers[i]) ? readers[i].bufs[readers[i].cur][0] : LLONG_MAX;
+        tree[i] = k; // index k is a virtual leaf that beats every run until the tree is built
+    }
+    keys[k] = LLONG_MIN;
+    for(int i=k-1; i>=0; i--)
+        loserTreeAdjust(tree, keys, k, i);
+
+    int* out_bufs[2] = {malloc(out_size), malloc(out_size)};
+    int out_cur = 0, out_len = 0, out_cap = out_size / sizeof(int);
+    off_t out_offset = 0;
+    write_req.done = 1;
+    while(k > 0 && keys[tree[0]] != LLONG_MAX)
+    {
+        int w = tree[0];
+        runReader* r = &readers[w];
+        out_bufs[out_cur][out_len++] = (int)keys[w];
+        if(out_len == out_cap)
         {
-            fprintf(stderr, RED "Failed to create child thread: defaulting to normal merge sort\n" RESET);
-            normalMergeSort(arr, mid+1, ub);
-            pthread_join(tid1, NULL);
-            merge(arr, lb, mid, ub);
-            return NULL;
+            ioWait(&q, &write_req);
+            ioSubmit(&q, &write_req, out_fd, 1, out_bufs[out_cur], out_len * sizeof(int), out_offset);
+            out_offset += out_len * sizeof(int);
+            out_cur = !out_cur;
+            out_len = 0;
         }
+        if(++r->pos == r->len && readerAdvance(&q, r) == 0)
+            keys[w] = LLONG_MAX; // run exhausted
+        else
+            keys[w] = r->bufs[r->cur][r->pos];
+        loserTreeAdjust(tree, keys, k, w);
+    }
+    ioWait(&q, &write_req);
+    if(out_len > 0)
+    {
+        ioSubmit(&q, &write_req, out_fd, 1, out_bufs[out_cur], out_len * sizeof(int), out_offset);
+        ioWait(&q, &write_req);
+        out_offset += out_len * sizeof(int);
+    }
+    t_merge = getTime(ts) - start_time;
 
-        pthread_join(tid1, NULL);
-        pthread_join(tid2, NULL);
+    pthread_mutex_lock(&q.mutex);
+    q.shutdown = 1;
+    pthread_cond_signal(&q.submitted);
+    pthread_mutex_unlock(&q.mutex);
+    pthread_join(q.thread, NULL);
 
-        merge(arr, lb, mid, ub);
+    for(int i=0; i<k; i++)
+    {
+        free(readers[i].bufs[0]);
+        free(readers[i].bufs[1]);
     }
-    else
-        selectionSort(arr, lb, ub);
+    free(readers);
+    free(keys);
+    free(tree);
+    free(out_bufs[0]);
+    free(out_bufs[1]);
+    free(run_offsets);
+    close(run_fd);
+    close(in_fd);
+    close(out_fd);
 
-    return NULL;
+    printf("Sorted %lld 32-bit integers from %s into %s using %d run(s)\n", (long long)(out_offset / sizeof(int)), input_file, output_file, num_runs);
+    printf(GREEN "Time taken to sort and spill runs = %Lf\n" RESET, t_runs);
+    printf(GREEN "Time taken to merge runs = %Lf\n" RESET, t_merge);
+}
+
+
+// ------------------- STREAMING MERGESORT -------------------
+// --stream overlaps parsing with sorting: every STREAM_CHUNK integers parsed from the input are submitted to the
+// thread pool, which sorts them while the next chunk is parsed. Once the last chunk is sorted, all chunks are merged
+// through a loser tree straight into the output buffer, without another pass over memory
+void streamMergeSort(int n, inputBuffer* in, int out_fd)
+{
+    struct timespec ts;
+    long double start_time, t_parse = 0, t_sorted, t_merge, parse_start;
+    start_time = getTime(ts);
+
+    int num_chunks = (n > 0) ? (int)(((long)n + STREAM_CHUNK-1) / STREAM_CHUNK) : 0;
+    int *arr = malloc(sizeof(int) * (n > 0 ? n : 1));
+    int *buf = malloc(sizeof(int) * (n > 0 ? n : 1));
+    streamChunk* chunks = malloc(sizeof(streamChunk) * (num_chunks > 0 ? num_chunks : 1));
+    if(arr == NULL || buf == NULL || chunks == NULL)
+    {
+        fprintf(stderr, RED "Failed to allocate %d integers for the streaming sort\n" RESET, n);
+        exit(1);
+    }
+
+    // phase 1: parse a chunk, hand it to the pool, parse the next one
+    int read = 0, k = 0;
+    while(read < n)
+    {
+        parse_start = getTime(ts);
+        int len = readIntegers(in, arr + read, (n - read < STREAM_CHUNK) ? n - read : STREAM_CHUNK);
+        t_parse += getTime(ts) - parse_start;
+        if(len == 0)
+            break;
+        chunks[k].ai = (arrayInfo){read, read+len-1, arr, buf, 0};
+        if(sort_pool->num_workers > 0)
+            poolSpawn(sort_pool, &chunks[k].t, threadedMergeSort, (void*)(&chunks[k].ai));
+        else
+            threadedMergeSort((void*)(&chunks[k].ai));
+        read += len;
+        k++;
+    }
+    if(read < n)
+        fprintf(stderr, RED "Expected %d integers but read %d: sorting the %d read\n" RESET, n, read, read);
+
+    // phase 2: k-way merge of the sorted chunks
+    long long* keys = malloc(sizeof(long long) * (k + 1));
+    int* tree = malloc(sizeof(int) * (k > 0 ? k : 1));
+    int* next = malloc(sizeof(int) * (k > 0 ? k : 1)); // next unmerged element of every chunk
+    for(int i=0; i<k; i++)
+    {
+        if(sort_pool->num_workers > 0)
+            poolWait(sort_pool, &chunks[i].t);
+        next[i] = chunks[i].ai.lb;
+        keys[i] = arr[next[i]];
+        tree[i] = k; // index k is a virtual leaf that beats every chunk until the tree is built
+    }
+    t_sorted = getTime(ts) - start_time;
+
+    start_time = getTime(ts);
+    keys[k] = LLONG_MIN;
+    for(int i=k-1; i>=0; i--)
+        loserTreeAdjust(tree, keys, k, i);
+    outputBuffer out = {out_fd, malloc(IO_BUFFER_SIZE), 0};
+    while(k > 0 && keys[tree[0]] != LLONG_MAX)
+    {
+        int w = tree[0];
+        writeInteger(&out, (int)keys[w], ' ');
+        keys[w] = (++next[w] <= chunks[w].ai.ub) ? arr[next[w]] : LLONG_MAX;
+        loserTreeAdjust(tree, keys, k, w);
+    }
+    out.data[out.len++] = '\n';
+    flushOutput(&out);
+    t_merge = getTime(ts) - start_time;
+
+    free(out.data);
+    free(keys);
+    free(tree);
+    free(next);
+    free(chunks);
+    free(arr);
+    free(buf);
+
+    // the sorted integers may be on stdout, so the report goes to stderr
+    fprintf(stderr, "Sorted %d integers in %d chunk(s) of at most %d\n", read, k, STREAM_CHUNK);
+    fprintf(stderr, GREEN "Time taken to parse the input = %Lf\n" RESET, t_parse);
+    fprintf(stderr, GREEN "Time until every chunk was sorted = %Lf (%Lf after the input was parsed)\n" RESET, t_sorted,
+            t_sorted - t_parse);
+    fprintf(stderr, GREEN "Time taken by the %d-way merge and output = %Lf\n" RESET, k, t_merge);
 }
 
 
 // ------------------- RUN MERGESORTS  -------------------
-void runMergeSorts(int n)
+void runMergeSorts(int n, inputBuffer* in)
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-    long double start_time, t1, t2, t3;
+    long double start_time, t1, t2, t3, t4, t5, t6 = 0, t7, t8 = 0, t9 = 0, t10;
+    perfReport report; // hardware and software event counts of each variant (--perf)
 
-    int *arr = shareMem(sizeof(int) * (n+1));
-    for(int i=0; i<n; i++)
-        scanf("%d", &arr[i]);
+    int *arr = shareMem(sizeof(int) * (n+1), &shm_id);
+    int *buf = shareMem(sizeof(int) * (n+1), &buf_shm_id); // one merge buffer shared by all parallel sorts
+    if(numa_mode)
+        numaFirstTouch(arr, buf, n);
+    int read = readIntegers(in, arr, n);
+    if(read < n)
+    {
+        fprintf(stderr, RED "Expected %d integers but read %d: remaining elements are 0\n" RESET, n, read);
+        for(int i=read; i<n; i++)
+            arr[i] = 0;
+    }
 
     int *arr_copy1 = malloc(sizeof(int) * (n+1));
     int *arr_copy2 = malloc(sizeof(int) * (n+1));
+    int *arr_copy3 = malloc(sizeof(int) * (n+1));
+    int *arr_copy4 = malloc(sizeof(int) * (n+1));
+    int *arr_copy5 = malloc(sizeof(int) * (n+1));
+    int *arr_copy6 = malloc(sizeof(int) * (n+1));
     for(int i=0; i<n; i++)
-        arr_copy1[i] = arr_copy2[i] = arr[i];
+        arr_copy1[i] = arr_copy2[i] = arr_copy3[i] = arr_copy4[i] = arr_copy5[i] = arr_copy6[i] = arr[i];
+    int *select_arr = NULL, *partial_arr = NULL, k = (top_k < n) ? top_k : n;
+    if(k > 0)
+    {
+        select_arr = malloc(sizeof(int) * (n+1));
+        partial_arr = malloc(sizeof(int) * (n+1));
+        memcpy(select_arr, arr, sizeof(int) * n);
+        memcpy(partial_arr, arr, sizeof(int) * n);
+    }
+    int *numa_arr = NULL, *numa_buf = NULL;
+    if(numa_mode)
+    {
+        numa_arr = malloc(sizeof(int) * (n+1));
+        numa_buf = malloc(sizeof(int) * (n+1));
+        numaFirstTouch(numa_arr, numa_buf, n);
+        memcpy(numa_arr, arr, sizeof(int) * n);
+    }
+    int *small_arr = NULL, *small_buf = NULL, small_id, small_buf_id;
+    const char* huge_backing = share_backing;
+    if(huge_pages)
+    {
+        // the same segments on normal pages, to measure what the huge pages save
+        printf("Shared memory backed by %s\n\n", huge_backing);
+        huge_pages = 0;
+        small_arr = shareMem(sizeof(int) * (n+1), &small_id);
+        small_buf = shareMem(sizeof(int) * (n+1), &small_buf_id);
+        huge_pages = 1;
+        memcpy(small_arr, arr, sizeof(int) * n);
+    }
 
     // concurrent mergesort
     printf("Running concurrent mergesort\n");
+    perfStart(&report, n);
     start_time = getTime(ts);
 
-    concurrentMergeSort(arr, 0, n-1);
+    concurrentMergeSort(arr, buf, 0, n-1, 0, 0);
 
     t1 = getTime(ts) - start_time;
+    perfStop(&report);
     printArray(arr, n);
-    printf(GREEN "Time taken by concurrent mergesort = %Lf\n\n" RESET, t1);
+    printf(GREEN "Time taken by concurrent mergesort = %Lf\n" RESET, t1);
+    perfPrint(&report);
+    printf("\n");
+
+    if(huge_pages)
+    {
+        long long huge_tlb_misses = perfTotal(&report, PERF_DTLB_EVENT);
+        printf("Running concurrent mergesort on 4K pages\n");
+        perfStart(&report, n);
+        start_time = getTime(ts);
+
+        concurrentMergeSort(small_arr, small_buf, 0, n-1, 0, 0);
+
+        long double t_small = getTime(ts) - start_time;
+        perfStop(&report);
+        printArray(small_arr, n);
+        printf(GREEN "Time taken by concurrent mergesort on 4K pages = %Lf\n" RESET, t_small);
+        perfPrint(&report);
+        long long small_tlb_misses = perfTotal(&report, PERF_DTLB_EVENT);
+        printf(GREEN "Concurrent mergesort on %s ran [ %Lf ] times faster than on 4K pages\n" RESET, huge_backing,
+               t_small / t1);
+        if(huge_tlb_misses >= 0 && small_tlb_misses > 0)
+            printf(GREEN "dTLB load misses reduced by [ %.1f%% ] (%lld on 4K pages, %lld on %s)\n" RESET,
+                   100.0 * (small_tlb_misses - huge_tlb_misses) / small_tlb_misses, small_tlb_misses, huge_tlb_misses,
+                   huge_backing);
+        else
+            printf("dTLB load misses not counted (needs --perf and a CPU that exposes the event)\n");
+        printf("\n");
+        unshareMem(small_arr, sizeof(int) * (n+1), small_id);
+        unshareMem(small_buf, sizeof(int) * (n+1), small_buf_id);
+    }
 
     //multi-threaded mergesort
-    pthread_t tid;
-    arrayInfo ai = {0, n-1, arr_copy1};
+    arrayInfo ai = {0, n-1, arr_copy1, buf, 0};
     printf("Running multi-threaded mergesort\n");
+    perfStart(&report, n);
     start_time = getTime(ts);
 
-    pthread_create(&tid, NULL, threadedMergeSort, (void*)(&ai));
-    pthread_join(tid, NULL);
+    poolRun(sort_pool, threadedMergeSort, (void*)(&ai));
 
     t2 = getTime(ts) - start_time;
+    perfStop(&report);
     printArray(arr_copy1, n);
-    printf(GREEN "Time taken by multi-threaded mergesort = %Lf\n\n" RESET, t2);
+    printf(GREEN "Time taken by multi-threaded mergesort = %Lf\n" RESET, t2);
+    perfPrint(&report);
+    printf("\n");
+
+    // bottom-up mergesort
+    printf("Running bottom-up mergesort\n");
+    start_time = getTime(ts);
+
+    bottomUpMergeSort(arr_copy6, buf, n);
+
+    t10 = getTime(ts) - start_time;
+    printArray(arr_copy6, n);
+    printf(GREEN "Time taken by bottom-up mergesort = %Lf\n\n" RESET, t10);
 
     // normal mergesort
     printf("Running normal mergesort\n");
+    perfStart(&report, n);
     start_time = getTime(ts);
 
     normalMergeSort(arr_copy2, 0, n-1);
 
     t3 = getTime(ts) - start_time;
+    perfStop(&report);
     printArray(arr_copy2, n);
-    printf(GREEN "Time taken by normal mergesort = %Lf\n\n" RESET, t3);
+    printf(GREEN "Time taken by normal mergesort = %Lf\n" RESET, t3);
+    perfPrint(&report);
+    printf("\n");
+
+    // radix sort
+    printf("Running radix sort\n");
+    start_time = getTime(ts);
+
+    radixSort(arr_copy3, buf, n);
+
+    t4 = getTime(ts) - start_time;
+    printArray(arr_copy3, n);
+    printf(GREEN "Time taken by radix sort = %Lf\n\n" RESET, t4);
+
+    // adaptive mergesort
+    printf("Running adaptive mergesort\n");
+    start_time = getTime(ts);
+
+    adaptiveMergeSort(arr_copy4, buf, n);
+
+    t5 = getTime(ts) - start_time;
+    printArray(arr_copy4, n);
+    printf(GREEN "Time taken by adaptive mergesort = %Lf\n\n" RESET, t5);
+
+    // sample sort
+    printf("Running sample sort\n");
+    start_time = getTime(ts);
+
+    sampleSort(arr_copy5, buf, n);
+
+    t7 = getTime(ts) - start_time;
+    printArray(arr_copy5, n);
+    printf(GREEN "Time taken by sample sort = %Lf\n\n" RESET, t7);
+
+    // selection and partial sort
+    if(k > 0)
+    {
+        printf("Running parallel selection (k = %d)\n", k);
+        start_time = getTime(ts);
+
+        nthElement(select_arr, buf, n, k-1);
+
+        t8 = getTime(ts) - start_time;
+        printf("%d-th smallest element = %d\n", k, select_arr[k-1]);
+        printf(GREEN "Time taken by parallel selection = %Lf\n\n" RESET, t8);
+
+        printf("Running partial sort (k = %d)\n", k);
+        start_time = getTime(ts);
+
+        partialSort(partial_arr, buf, n, k);
+
+        t9 = getTime(ts) - start_time;
+        printArray(partial_arr, k);
+        printf(GREEN "Time taken by partial sort = %Lf\n\n" RESET, t9);
+    }
+
+    // NUMA-aware mergesort
+    if(numa_mode)
+    {
+        printf("Running NUMA-aware mergesort (%d node(s), %d worker(s))\n", num_numa_nodes, sort_pool->num_workers);
+        start_time = getTime(ts);
+
+        numaMergeSort(numa_arr, numa_buf, n);
+
+        t6 = getTime(ts) - start_time;
+        printArray(numa_arr, n);
+        printf(GREEN "Time taken by NUMA-aware mergesort = %Lf\n\n" RESET, t6);
+    }
 
     // compare implementations
     printf(GREEN "Normal mergesort ran [ %Lf ] times faster than concurrent mergesort\n" RESET, t1 / t3);
     printf(GREEN "Normal mergesort ran [ %Lf ] times faster than multi-threaded mergesort\n" RESET, t2 / t3);
+    printf(GREEN "Normal mergesort ran [ %Lf ] times faster than bottom-up mergesort\n" RESET, t10 / t3);
+    printf(GREEN "Normal mergesort ran [ %Lf ] times faster than radix sort\n" RESET, t4 / t3);
+    printf(GREEN "Normal mergesort ran [ %Lf ] times faster than adaptive mergesort\n" RESET, t5 / t3);
+    printf(GREEN "Normal mergesort ran [ %Lf ] times faster than sample sort\n" RESET, t7 / t3);
+    if(k > 0)
+    {
+        printf(GREEN "Normal mergesort ran [ %Lf ] times faster than parallel selection\n" RESET, t8 / t3);
+        printf(GREEN "Normal mergesort ran [ %Lf ] times faster than partial sort\n" RESET, t9 / t3);
+    }
+    if(numa_mode)
+        printf(GREEN "Normal mergesort ran [ %Lf ] times faster than NUMA-aware mergesort\n" RESET, t6 / t3);
 
     free(arr_copy1);
     free(arr_copy2);
-    shmdt(arr);
-    shmctl(shm_id, IPC_RMID, NULL);
+    free(arr_copy3);
+    free(arr_copy4);
+    free(arr_copy5);
+    free(arr_copy6);
+    free(select_arr);
+    free(partial_arr);
+    free(numa_arr);
+    free(numa_buf);
+    unshareMem(arr, sizeof(int) * (n+1), shm_id);
+    unshareMem(buf, sizeof(int) * (n+1), buf_shm_id);
 }
 
-int main()
+# ifndef MERGESORT_NO_MAIN
+int main(int argc, char* argv[])
 {
-    int n;
-    scanf("%d", &n);
-    runMergeSorts(n);
+    static struct option long_options[] = {
+        {"fork-depth", required_argument, NULL, 'd'},
+        {"min-segment", required_argument, NULL, 's'},
+        {"leaf", required_argument, NULL, 'l'},
+        {"leaf-cutoff", required_argument, NULL, 'c'},
+        {"calibrate", no_argument, NULL, 'C'},
+        {"input", required_argument, NULL, 'i'},
+        {"output", required_argument, NULL, 'o'},
+        {"type", required_argument, NULL, 't'},
+        {"external", no_argument, NULL, 'x'},
+        {"memory", required_argument, NULL, 'm'},
+        {"temp-dir", required_argument, NULL, 'T'},
+        {"radix-bits", required_argument, NULL, 'r'},
+        {"perf", no_argument, NULL, 'p'},
+        {"numa", no_argument, NULL, 'N'},
+        {"huge-pages", no_argument, NULL, 'H'},
+        {"top-k", required_argument, NULL, 'k'},
+        {"stream", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt, calibrate = 0, external = 0, stream = 0;
+    const elementType* type = &element_types[0];
+    size_t memory = (size_t)DEFAULT_EXTERNAL_MEMORY << 20;
+    char *input_file = NULL, *output_file = NULL, *temp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    while((opt = getopt_long(argc, argv, "d:s:l:c:Ci:o:t:xm:T:r:pNHk:S", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'd':
+                max_fork_depth = atoi(optarg);
+                break;
+            case 's':
+                min_fork_segment = atoi(optarg) > 2 ? atoi(optarg) : 2;
+                break;
+            case 'l':
+                leafSort = NULL;
+                for(int i=0; i<NUM_LEAF_STRATEGIES; i++)
+                    if(strcmp(optarg, leaf_strategies[i].name) == 0)
+                        leafSort = leaf_strategies[i].sort;
+                if(leafSort == NULL)
+                {
+                    fprintf(stderr, "Unknown leaf sort '%s' (insertion, network or natural)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                leaf_cutoff = atoi(optarg);
+                leaf_cutoff = (leaf_cutoff < 2) ? 2 : (leaf_cutoff > MAX_LEAF_CUTOFF) ? MAX_LEAF_CUTOFF : leaf_cutoff;
+                break;
+            case 'C':
+                calibrate = 1;
+                break;
+            case 'i':
+                input_file = optarg;
+                break;
+            case 'o':
+                output_file = optarg;
+                break;
+            case 't':
+                type = NULL;
+                for(int i=0; i<NUM_ELEMENT_TYPES; i++)
+                    if(strcmp(optarg, element_types[i].name) == 0)
+                        type = &element_types[i];
+                if(type == NULL)
+                {
+                    fprintf(stderr, "Unknown element type '%s' (int32, int64, uint64, float, double or record)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'x':
+                external = 1;
+                break;
+            case 'm':
+                memory = (size_t)(atol(optarg) > 1 ? atol(optarg) : 1) << 20;
+                break;
+            case 'T':
+                temp_dir = optarg;
+                break;
+            case 'r':
+                radix_bits = atoi(optarg);
+                if(radix_bits != 8 && radix_bits != 11)
+                {
+                    fprintf(stderr, "Radix sort digits must be 8 or 11 bits\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+# ifndef NO_PERF_COUNTERS
+                perf_enabled = 1;
+# else
+                fprintf(stderr, "Compiled without performance counters (NO_PERF_COUNTERS): ignoring --perf\n");
+# endif
+                break;
+            case 'N':
+                numa_mode = 1;
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
+            case 'k':
+                top_k = atoi(optarg);
+                break;
+            case 'S':
+                stream = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--fork-depth D] [--min-segment S] [--leaf insertion|network|natural] "
+                                "[--leaf-cutoff C] [--calibrate] [--radix-bits 8|11] [--top-k K]\n"
+                                "       %*s [--perf] [--numa] [--huge-pages] < input\n"
+                                "       %s --input FILE [--output FILE] [--type int32|int64|uint64|float|double|record] [options]\n"
+                                "       %s --external --input FILE --output FILE [--memory MB] [--temp-dir DIR] [options]\n"
+                                "       %s --stream [--output FILE] [options] < input\n",
+                                argv[0], (int)strlen(argv[0]), "", argv[0], argv[0], argv[0]);
+                return 1;
+        }
+    }
+
+    initKernels();
+    if(calibrate)
+        calibrateLeaf();
+
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_cores < 1)
+        num_cores = 1;
+    if(numa_mode)
+        numaInit();
+    sort_pool = poolCreate((int)num_cores);
+    if(perf_enabled)
+        perfOpen(&perf_main, 1); // after the workers are created, which count themselves
+    if(max_fork_depth < 0)
+        for(max_fork_depth = 0; (1L << max_fork_depth) < num_cores; max_fork_depth++);
+
+    if(external)
+    {
+        if(input_file == NULL || output_file == NULL || type != &element_types[0])
+        {
+            fprintf(stderr, "The external sort needs --input and --output files of 32-bit integers\n");
+            return 1;
+        }
+        externalMergeSort(input_file, output_file, temp_dir, memory);
+    }
+    else if(stream)
+    {
+        int out_fd = (output_file != NULL) ? open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+        if(out_fd == -1)
+        {
+            perror(output_file);
+            return 1;
+        }
+        inputBuffer in;
+        initInput(&in, STDIN_FILENO);
+        int n = 0;
+        readInteger(&in, &n);
+        streamMergeSort(n, &in, out_fd);
+        free(in.data);
+        if(out_fd != STDOUT_FILENO)
+            close(out_fd);
+    }
+    else if(input_file != NULL)
+        sortFile(input_file, output_file, type);
+    else
+    {
+        inputBuffer in;
+        initInput(&in, STDIN_FILENO);
+        int n = 0;
+        readInteger(&in, &n);
+        runMergeSorts(n, &in);
+        free(in.data);
+    }
+    poolDestroy(sort_pool);
+    if(perf_enabled)
+        perfClose(&perf_main);
     return 0;
 }
+# endif
@@ -0,0 +1,44 @@
+// ------------------- CONCURRENT MERGESORT LIBRARY INTERFACE -------------------
+// Functions of concurrent_mergesort.c that can be called from other programs.
+// Compile concurrent_mergesort.c with -DMERGESORT_NO_MAIN to link it into a program with its own main.
+# ifndef CONCURRENT_MERGESORT_H
+# define CONCURRENT_MERGESORT_H
+# include <stddef.h>
+
+typedef struct threadPool threadPool;
+
+typedef struct sortSegment {
+    int* data;
+    int n;
+} sortSegment;
+
+extern threadPool* sort_pool; // pool used by multi-threaded mergesort (create with poolCreate before sorting)
+extern int max_fork_depth; // depth of the fork tree of concurrentMergeSort
+extern int min_fork_segment; // segments smaller than this are never split across processes
+extern int huge_pages; // back shareMem segments with huge pages where the system allows it
+
+// ------------------- SETUP -------------------
+void sortInit(int num_workers); // kernels, sort_pool and fork depth in one call (num_workers < 1: one per online core)
+void sortShutdown();
+void initKernels(); // picks the SIMD kernels supported by the CPU
+void numaInit(); // optional, before poolCreate: pins the workers to CPUs node by node
+threadPool* poolCreate(int num_workers);
+void poolDestroy(threadPool* pool);
+int * shareMem(size_t size, int* id); // shared memory for concurrentMergeSort (huge pages if huge_pages is set)
+void unshareMem(int* mem, size_t size, int id); // releases memory returned by shareMem
+
+// ------------------- SORTS OF int ARRAYS -------------------
+void normalMergeSort(int* arr, int lb, int ub);
+void concurrentMergeSort(int* arr, int* buf, int lb, int ub, int depth, int to_buf); // arr and buf from shareMem
+void parallelMergeSort(int* arr, int n); // multi-threaded mergesort on sort_pool
+void bottomUpMergeSort(int* arr, int* buf, int n); // iterative, L2-sized blocks then 8-way merge passes
+void radixSort(int* arr, int* buf, int n); // buf holds at least n elements
+void sampleSort(int* arr, int* buf, int n); // one parallel partition into buckets, then sequential bucket sorts
+void nthElement(int* arr, int* buf, int n, int k); // arr[k] as in the sorted array, smaller before, larger after
+void partialSort(int* arr, int* buf, int n, int k); // the k smallest elements sorted into arr[0..k-1]
+void adaptiveMergeSort(int* arr, int* buf, int n); // natural runs, near-linear on presorted input, buf as radixSort
+void numaFirstTouch(int* arr, int* buf, int n); // places the pages of new arrays on the nodes of the workers
+void numaMergeSort(int* arr, int* buf, int n); // one partition per worker, arr and buf from numaFirstTouch
+void sortBatch(sortSegment* segments, int num_segments); // many arrays in one submission to sort_pool
+
+# endif
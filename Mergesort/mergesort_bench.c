@@ -0,0 +1,311 @@
+# define _GNU_SOURCE //required for clock and getopt_long
+# include <sys/types.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <time.h>
+# include <math.h>
+# include <stdint.h>
+# include <getopt.h>
+# include "concurrent_mergesort.h"
+# define MAX_SWEEP 32 // maximum number of values in --sizes and --threads
+# define ZIPF_UNIVERSE (1 << 20) // number of distinct values drawn by the zipf distribution
+
+
+// ------------------- GLOBAL STRUCTURES -------------------
+typedef struct variant {
+    const char* name;
+    int parallel; // whether the variant is run once per thread count
+} variant;
+
+typedef struct result {
+    const char* distribution;
+    const char* variant;
+    int n;
+    int threads;
+    double median;
+    double p95;
+} result;
+
+
+// ------------------- GLOBAL VARIABLES -------------------
+const char* distributions[] = {"random", "sorted", "reverse", "few-unique", "organ-pipe", "zipf"};
+# define NUM_DISTRIBUTIONS (int)(sizeof(distributions) / sizeof(char*))
+
+variant variants[] = {
+    {"normal", 0},
+    {"concurrent", 1},
+    {"multi-threaded", 1},
+    {"bottom-up", 1},
+    {"radix", 1},
+    {"adaptive", 1},
+    {"sample", 1}
+};
+# define NUM_VARIANTS (int)(sizeof(variants) / sizeof(variant))
+
+uint64_t rng_state;
+
+
+// ------------------- HELPER FUNCTIONS -------------------
+uint64_t nextRandom()
+{
+    // splitmix64, so the generated inputs are the same on every platform for a given seed
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+double getSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_nsec/(1e9) + ts.tv_sec;
+}
+
+int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int parseList(char* arg, int* values)
+{
+    // comma separated list of positive integers, returns the number of values
+    int count = 0;
+    for(char* tok = strtok(arg, ","); tok != NULL && count < MAX_SWEEP; tok = strtok(NULL, ","))
+        if(atof(tok) >= 1)
+            values[count++] = (int)atof(tok);
+    return count;
+}
+
+
+// ------------------- INPUT GENERATION -------------------
+void generateInput(int* arr, int n, const char* distribution, uint64_t seed)
+{
+    rng_state = seed;
+    if(strcmp(distribution, "random") == 0)
+        for(int i=0; i<n; i++)
+            arr[i] = (int)(uint32_t)nextRandom();
+    else if(strcmp(distribution, "sorted") == 0)
+        for(int i=0; i<n; i++)
+            arr[i] = i;
+    else if(strcmp(distribution, "reverse") == 0)
+        for(int i=0; i<n; i++)
+            arr[i] = n-i;
+    else if(strcmp(distribution, "few-unique") == 0)
+        for(int i=0; i<n; i++)
+            arr[i] = (int)(nextRandom() % 16);
+    else if(strcmp(distribution, "organ-pipe") == 0)
+        for(int i=0; i<n; i++)
+            arr[i] = (i < n/2) ? i : n-i;
+    else
+    {
+        // zipf with exponent 1: value v is drawn with probability proportional to 1/v
+        int m = (n < ZIPF_UNIVERSE) ? n : ZIPF_UNIVERSE;
+        double* cdf = malloc(sizeof(double) * m);
+        double sum = 0;
+        for(int v=0; v<m; v++)
+            cdf[v] = (sum += 1.0 / (v+1));
+        for(int i=0; i<n; i++)
+        {
+            double u = (nextRandom() >> 11) * (1.0 / 9007199254740992.0) * sum;
+            int lo = 0, hi = m-1;
+            while(lo < hi)
+            {
+                int mid = lo + (hi-lo)/2;
+                if(cdf[mid] < u)
+                    lo = mid+1;
+                else
+                    hi = mid;
+            }
+            arr[i] = lo;
+        }
+        free(cdf);
+    }
+}
+
+
+// ------------------- BENCHMARK -------------------
+double runVariant(const char* name, int* arr, int* buf, int n)
+{
+    double start = getSeconds();
+    if(strcmp(name, "normal") == 0)
+        normalMergeSort(arr, 0, n-1);
+    else if(strcmp(name, "concurrent") == 0)
+        concurrentMergeSort(arr, buf, 0, n-1, 0, 0);
+    else if(strcmp(name, "multi-threaded") == 0)
+        parallelMergeSort(arr, n);
+    else if(strcmp(name, "bottom-up") == 0)
+        bottomUpMergeSort(arr, buf, n);
+    else if(strcmp(name, "radix") == 0)
+        radixSort(arr, buf, n);
+    else if(strcmp(name, "adaptive") == 0)
+        adaptiveMergeSort(arr, buf, n);
+    else
+        sampleSort(arr, buf, n);
+    double t = getSeconds() - start;
+
+    for(int i=1; i<n; i++)
+    {
+        if(arr[i-1] > arr[i])
+        {
+            fprintf(stderr, "%s produced an unsorted array (n = %d)\n", name, n);
+            exit(1);
+        }
+    }
+    return t;
+}
+
+result measure(const char* distribution, const char* name, int n, int threads, const int* input, int* arr, int* buf,
+               int warmups, int trials)
+{
+    double* times = malloc(sizeof(double) * trials);
+    for(int i=0; i<warmups+trials; i++)
+    {
+        memcpy(arr, input, sizeof(int) * n);
+        double t = runVariant(name, arr, buf, n);
+        if(i >= warmups)
+            times[i-warmups] = t;
+    }
+    qsort(times, trials, sizeof(double), compareDoubles);
+    int p95 = (int)ceil(0.95 * trials) - 1;
+    result r = {distribution, name, n, threads, times[trials/2], times[p95 > 0 ? p95 : 0]};
+    if(trials % 2 == 0)
+        r.median = (times[trials/2 - 1] + times[trials/2]) / 2;
+    free(times);
+    return r;
+}
+
+void printResult(const result* r, double baseline, const char* format, int first)
+{
+    double rate = r->n / r->median;
+    double speedup = baseline / r->median;
+    if(strcmp(format, "json") == 0)
+        printf("%s  {\"distribution\": \"%s\", \"variant\": \"%s\", \"n\": %d, \"threads\": %d, \"median_s\": %.9f, "
+               "\"p95_s\": %.9f, \"elements_per_s\": %.1f, \"speedup_vs_normal\": %.4f}",
+               first ? "" : ",\n", r->distribution, r->variant, r->n, r->threads, r->median, r->p95, rate, speedup);
+    else
+        printf("%s,%s,%d,%d,%.9f,%.9f,%.1f,%.4f\n", r->distribution, r->variant, r->n, r->threads, r->median, r->p95,
+               rate, speedup);
+    fflush(stdout);
+}
+
+
+// ------------------- MAIN -------------------
+int main(int argc, char* argv[])
+{
+    static struct option long_options[] = {
+        {"sizes", required_argument, NULL, 'n'},
+        {"threads", required_argument, NULL, 't'},
+        {"distributions", required_argument, NULL, 'D'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"trials", required_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, 'S'},
+        {"format", required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int sizes[MAX_SWEEP] = {10000, 100000, 1000000, 10000000}, num_sizes = 4;
+    int threads[MAX_SWEEP], num_threads = 0;
+    for(int t=1; t<num_cores && num_threads<MAX_SWEEP-1; t*=2)
+        threads[num_threads++] = t;
+    threads[num_threads++] = (num_cores > 0) ? (int)num_cores : 1;
+    char* selected_distributions = NULL;
+    int warmups = 1, trials = 5;
+    uint64_t seed = 1;
+    const char* format = "csv";
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "n:t:D:w:r:S:f:", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                num_sizes = parseList(optarg, sizes);
+                break;
+            case 't':
+                num_threads = parseList(optarg, threads);
+                break;
+            case 'D':
+                selected_distributions = optarg;
+                break;
+            case 'w':
+                warmups = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'r':
+                trials = atoi(optarg) > 1 ? atoi(optarg) : 1;
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--sizes N1,N2,..] [--threads T1,T2,..] [--distributions D1,D2,..] "
+                                "[--warmup W] [--trials R] [--seed S] [--format csv|json]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(num_sizes == 0 || num_threads == 0)
+    {
+        fprintf(stderr, "--sizes and --threads need at least one positive value\n");
+        return 1;
+    }
+
+    int max_n = 0;
+    for(int i=0; i<num_sizes; i++)
+        max_n = (sizes[i] > max_n) ? sizes[i] : max_n;
+    int arr_id, buf_id;
+    int* input = malloc(sizeof(int) * max_n);
+    int* arr = shareMem(sizeof(int) * max_n, &arr_id);
+    int* buf = shareMem(sizeof(int) * max_n, &buf_id);
+
+    initKernels();
+    if(strcmp(format, "json") == 0)
+        printf("[\n");
+    else
+        printf("distribution,variant,n,threads,median_s,p95_s,elements_per_s,speedup_vs_normal\n");
+
+    int first = 1;
+    for(int d=0; d<NUM_DISTRIBUTIONS; d++)
+    {
+        if(selected_distributions != NULL && strstr(selected_distributions, distributions[d]) == NULL)
+            continue;
+        for(int s=0; s<num_sizes; s++)
+        {
+            int n = sizes[s];
+            generateInput(input, n, distributions[d], seed);
+
+            // the sequential baseline does not depend on the number of threads
+            sort_pool = poolCreate(1);
+            result baseline = measure(distributions[d], "normal", n, 1, input, arr, buf, warmups, trials);
+            poolDestroy(sort_pool);
+            printResult(&baseline, baseline.median, format, first);
+            first = 0;
+
+            for(int t=0; t<num_threads; t++)
+            {
+                sort_pool = poolCreate(threads[t]);
+                for(max_fork_depth = 0; (1 << max_fork_depth) < threads[t]; max_fork_depth++);
+                for(int v=0; v<NUM_VARIANTS; v++)
+                {
+                    if(variants[v].parallel == 0)
+                        continue;
+                    result r = measure(distributions[d], variants[v].name, n, threads[t], input, arr, buf, warmups, trials);
+                    printResult(&r, baseline.median, format, 0);
+                }
+                poolDestroy(sort_pool);
+            }
+        }
+    }
+    if(strcmp(format, "json") == 0)
+        printf("\n]\n");
+
+    free(input);
+    unshareMem(arr, sizeof(int) * max_n, arr_id);
+    unshareMem(buf, sizeof(int) * max_n, buf_id);
+    return 0;
+}
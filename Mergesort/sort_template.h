@@ -0,0 +1,188 @@
+// ------------------- TYPE-SPECIALIZED MERGESORT TEMPLATE -------------------
+// Included once per element type by concurrent_mergesort.c with the following defined:
+//   SORT_TYPE    element type
+//   SORT_SUFFIX  appended to every generated name (e.g. Int64 -> normalMergeSortInt64)
+//   SORT_LESS    (optional) SORT_LESS(a, b) is non-zero when a sorts before b, defaults to a < b
+// The comparison is expanded inline in every generated function, so no function pointer is called per element.
+
+# ifndef SORT_LESS
+# define SORT_LESS(a, b) ((a) < (b))
+# endif
+# define SORT_CONCAT_(name, suffix) name ## suffix
+# define SORT_CONCAT(name, suffix) SORT_CONCAT_(name, suffix)
+# define SORT_FN(name) SORT_CONCAT(name, SORT_SUFFIX)
+
+typedef struct SORT_FN(arrayInfo) {
+    int lb;
+    int ub;
+    SORT_TYPE* arr;
+    SORT_TYPE* buf;
+    int to_buf;
+} SORT_FN(arrayInfo);
+
+typedef struct SORT_FN(mergeInfo) {
+    const SORT_TYPE* src;
+    SORT_TYPE* dst;
+    int lb;
+    int mid;
+    int ub;
+    int out_lb;
+    int out_ub;
+} SORT_FN(mergeInfo);
+
+void SORT_FN(insertionSort)(SORT_TYPE* arr, int lb, int ub)
+{
+    SORT_TYPE key;
+    int j;
+    for(int i=lb+1; i<=ub; i++)
+    {
+        key = arr[i];
+        for(j=i-1; j>=lb && SORT_LESS(key, arr[j]); j--)
+            arr[j+1] = arr[j];
+        arr[j+1] = key;
+    }
+}
+
+void SORT_FN(mergeRuns)(const SORT_TYPE* a, int len1, const SORT_TYPE* b, int len2, SORT_TYPE* out)
+{
+    int i = 0, j = 0, k = 0;
+    while(i < len1 && j < len2)
+    {
+        if(SORT_LESS(b[j], a[i]))
+            out[k++] = b[j++];
+        else
+            out[k++] = a[i++];
+    }
+    while(i < len1)
+        out[k++] = a[i++];
+    while(j < len2)
+        out[k++] = b[j++];
+}
+
+void SORT_FN(mergeSortTo)(SORT_TYPE* arr, SORT_TYPE* buf, int lb, int ub, int to_buf)
+{
+    if(ub-lb+1 > leaf_cutoff)
+    {
+        int mid = lb + (ub-lb)/2;
+        SORT_FN(mergeSortTo)(arr, buf, lb, mid, !to_buf);
+        SORT_FN(mergeSortTo)(arr, buf, mid+1, ub, !to_buf);
+        if(to_buf)
+            SORT_FN(mergeRuns)(arr+lb, mid-lb+1, arr+mid+1, ub-mid, buf+lb);
+        else
+            SORT_FN(mergeRuns)(buf+lb, mid-lb+1, buf+mid+1, ub-mid, arr+lb);
+    }
+    else
+    {
+        SORT_FN(insertionSort)(arr, lb, ub);
+        for(int i=lb; to_buf && i<=ub; i++)
+            buf[i] = arr[i];
+    }
+}
+
+void SORT_FN(normalMergeSort)(SORT_TYPE* arr, int lb, int ub)
+{
+    SORT_TYPE* buf = malloc(sizeof(SORT_TYPE) * (ub-lb+1));
+    if(buf == NULL)
+    {
+        fprintf(stderr, RED "Failed to allocate merge buffer\n" RESET);
+        exit(1);
+    }
+    SORT_FN(mergeSortTo)(arr + lb, buf, 0, ub-lb, 0);
+    free(buf);
+}
+
+int SORT_FN(coRank)(int k, const SORT_TYPE* a, int len1, const SORT_TYPE* b, int len2)
+{
+    int lo = (k - len2 > 0) ? k - len2 : 0;
+    int hi = (k < len1) ? k : len1;
+    while(lo < hi)
+    {
+        int i = lo + (hi-lo)/2;
+        if(!SORT_LESS(b[k-i-1], a[i]))
+            lo = i+1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+void* SORT_FN(parallelMerge)(void* input)
+{
+    SORT_FN(mergeInfo)* mi = (SORT_FN(mergeInfo)*)input;
+    if(mi->out_ub - mi->out_lb + 1 > SEQUENTIAL_CUTOFF)
+    {
+        int out_mid = mi->out_lb + (mi->out_ub - mi->out_lb)/2;
+        task left;
+        SORT_FN(mergeInfo) mi1 = *mi, mi2 = *mi;
+        mi1.out_ub = out_mid;
+        mi2.out_lb = out_mid+1;
+
+        poolSpawn(sort_pool, &left, SORT_FN(parallelMerge), (void*)(&mi1));
+        SORT_FN(parallelMerge)((void*)(&mi2));
+        poolSync(sort_pool, &left);
+    }
+    else
+    {
+        const SORT_TYPE* a = mi->src + mi->lb;
+        const SORT_TYPE* b = mi->src + mi->mid + 1;
+        int len1 = mi->mid - mi->lb + 1, len2 = mi->ub - mi->mid;
+        int i1 = SORT_FN(coRank)(mi->out_lb - mi->lb, a, len1, b, len2), j1 = mi->out_lb - mi->lb - i1;
+        int i2 = SORT_FN(coRank)(mi->out_ub + 1 - mi->lb, a, len1, b, len2), j2 = mi->out_ub + 1 - mi->lb - i2;
+        SORT_FN(mergeRuns)(a+i1, i2-i1, b+j1, j2-j1, mi->dst + mi->out_lb);
+    }
+    return NULL;
+}
+
+void* SORT_FN(threadedMergeSort)(void* input)
+{
+    SORT_FN(arrayInfo)* ai = (SORT_FN(arrayInfo)*)input;
+    int lb = ai->lb, ub = ai->ub, to_buf = ai->to_buf;
+    SORT_TYPE *arr = ai->arr, *buf = ai->buf;
+
+    if(ub-lb+1 > SEQUENTIAL_CUTOFF)
+    {
+        int mid = lb + (ub-lb)/2;
+        task left;
+        SORT_FN(arrayInfo) ai1 = {lb, mid, arr, buf, !to_buf};
+        SORT_FN(arrayInfo) ai2 = {mid+1, ub, arr, buf, !to_buf};
+
+        poolSpawn(sort_pool, &left, SORT_FN(threadedMergeSort), (void*)(&ai1));
+        SORT_FN(threadedMergeSort)((void*)(&ai2));
+        poolSync(sort_pool, &left);
+
+        SORT_FN(mergeInfo) mi = {to_buf ? arr : buf, to_buf ? buf : arr, lb, mid, ub, lb, ub};
+        if(ub-lb+1 > PARALLEL_MERGE_THRESHOLD)
+            SORT_FN(parallelMerge)((void*)(&mi));
+        else
+            SORT_FN(mergeRuns)(mi.src+lb, mid-lb+1, mi.src+mid+1, ub-mid, mi.dst+lb);
+    }
+    else
+        SORT_FN(mergeSortTo)(arr, buf, lb, ub, to_buf);
+    return NULL;
+}
+
+void SORT_FN(parallelMergeSort)(SORT_TYPE* arr, int n)
+{
+    // sorts arr[0..n-1] on sort_pool with a temporary n-sized merge buffer
+    SORT_TYPE* buf = malloc(sizeof(SORT_TYPE) * (n > 0 ? n : 1));
+    if(buf == NULL)
+    {
+        fprintf(stderr, RED "Failed to allocate merge buffer\n" RESET);
+        exit(1);
+    }
+    SORT_FN(arrayInfo) ai = {0, n-1, arr, buf, 0};
+    poolRun(sort_pool, SORT_FN(threadedMergeSort), (void*)(&ai));
+    free(buf);
+}
+
+void SORT_FN(sortData)(void* data, int n)
+{
+    SORT_FN(parallelMergeSort)((SORT_TYPE*)data, n);
+}
+
+# undef SORT_TYPE
+# undef SORT_SUFFIX
+# undef SORT_LESS
+# undef SORT_CONCAT_
+# undef SORT_CONCAT
+# undef SORT_FN
@@ -3,6 +3,9 @@
 # include <unistd.h>
 # include <pthread.h>
 # include <time.h>
+# include <getopt.h>
+# include <stdint.h>
+# include <stdatomic.h>
 # define RED "\033[0;31m"
 # define BLUE "\033[0;34m"
 # define GREEN "\033[0;32m"
@@ -10,24 +13,54 @@
 # define CYAN "\033[0;36m"
 # define MAGENTA "\e[0;35m"
 # define RESET "\033[m"
+# define MIN_ZONE_QUEUE 16 // initial size of the queue of students of a zone, doubled whenever it is full
+# define MAX_COMPANY_BATCHES 5 // batches prepared by a company at once (it resumes production once all are used)
+# define CACHE_LINE 64 // the two ends of the batch queue are kept on separate cache lines
+# define LOCK_BUCKETS 64 // lists of threads waiting for a mutex in virtual time, by mutex address
+# define STUDENT_NEW 0 // states of a student of the student pool
+# define STUDENT_ARRIVING 1
+# define STUDENT_WAITING 2
 
 // ------------------- MUTEXES AND CONDITION VARIABLES -------------------
-pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t used_batch = PTHREAD_COND_INITIALIZER; // signal from zone to company
-pthread_cond_t created_batch = PTHREAD_COND_INITIALIZER; // signal from company to zone
+typedef struct simCond {
+    pthread_cond_t cond;
+    int waiters; // threads waiting in virtual time
+    int wakeups; // waiters signalled in virtual time that have not woken up yet
+} simCond;
+# define SIM_COND_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0}
+
+pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER; // only taken to wait for or signal a change of the batch queue
+simCond used_batch = SIM_COND_INITIALIZER; // signal from zone to company
+simCond created_batch = SIM_COND_INITIALIZER; // signal from company to zone
+pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the virtual clock, the counts of every simCond
+                                                         // and the student pool
+pthread_cond_t work_available = PTHREAD_COND_INITIALIZER; // signal from zone or timer to idle student pool workers
+pthread_cond_t timer_changed; // signal to the student pool timer that an arrival has been scheduled (CLOCK_MONOTONIC)
+pthread_cond_t students_finished = PTHREAD_COND_INITIALIZER; // signal from the student pool to main that every student is done
 
 
 // ------------------- GLOBAL STRUCTURES -------------------
+typedef struct simEvent {
+    double time; // time at which the sleeping thread wakes up or the student arrives
+    long seq; // events at the same time happen in the order they were scheduled
+    int woken;
+    pthread_cond_t wake;
+    struct studentInfo* student; // student arriving at time (--student-pool), NULL for a sleeping thread
+} simEvent;
+
 typedef struct studentInfo {
     int student_num;
     int vaccination_round;
     int result;
+    int state; // STUDENT_NEW, STUDENT_ARRIVING or STUDENT_WAITING (--student-pool)
+    simEvent arrival;
+    struct studentInfo* next; // next student in the ready queue of the student pool
 } studentInfo;
 
 typedef struct companyInfo {
     int company_num;
     double success_prob;
-    int batches_left;
+    atomic_int batches_left; // batches created and not yet delivered to a zone
 } companyInfo;
 
 typedef struct batch {
@@ -35,82 +68,442 @@ typedef struct batch {
     companyInfo* company;
 } batch;
 
+typedef struct batchCell {
+    atomic_size_t sequence; // position the cell can be filled at, or that position + 1 once it holds a batch
+    batch data;
+} batchCell;
+
+typedef struct batchQueue {
+    batchCell* cells;
+    size_t mask; // number of cells - 1 (a power of two)
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+} batchQueue;
+
 typedef struct zoneInfo {
     int zone_num;
-    int available_students[10000]; // queue of students (numbers) available for vaccination at that zone
+    int* available_students; // queue of students (numbers) available for vaccination at that zone
     int add_ptr;
     int remove_ptr;
     int total_students; // number of remaining students waiting to be vaccinated at that zone
-    int MAX_STUDENT_NUM; // maximum possible number of available students at any point in time
+    int MAX_STUDENT_NUM; // size of available_students, which grows with the number of waiting students
     pthread_mutex_t slot_mutex;
-    pthread_cond_t filled_slot; // signal that student is available to fill slot
-    pthread_cond_t vaccinated; // signal that student has been vaccinated
+    simCond filled_slot; // signal that student is available to fill slot
+    simCond vaccinated; // signal that student has been vaccinated
 } zoneInfo;
 
+typedef struct lockWaiter {
+    pthread_mutex_t* mutex;
+    int woken;
+    pthread_cond_t wake;
+    struct lockWaiter* next;
+} lockWaiter;
+
+typedef struct threadStart {
+    void* (*function)(void*);
+    void* arg;
+} threadStart;
+
 
 // ------------------- BATCH RELATED GLOBAL VARIABLES -------------------
-companyInfo* all_companies[1000];
-batch available_batches[20000]; // queue of available batches to be used
-int fill_ptr = 0;
-int use_ptr = 0;
-int total_batches = 0; // number of available batches
+companyInfo** all_companies; // n companies
+batchQueue available_batches; // lock-free queue of available batches to be used
+atomic_int total_batches = 0; // number of available batches
+atomic_int waiting_zones = 0; // zones waiting on created_batch, a company only takes batch_mutex to signal if there are any
 int MAX_BATCH_NUM; // maximum possible number of available batches at any point in time
 
 
 // ------------------- STUDENT RELATED GLOBAL VARIABLES -------------------
-studentInfo* all_students[10000];
+studentInfo** all_students; // o students
+int total_students;
+int student_pool = 0; // --student-pool
+studentInfo* ready_head = NULL; // students whose next step can run, oldest first
+studentInfo* ready_tail = NULL;
+int idle_workers = 0;
+int worker_wakeups = 0; // idle workers signalled that have not woken up yet
+int finished_students = 0;
+int main_waiting = 0; // main is waiting for the students to finish
+int pool_shutdown = 0;
+struct timespec drive_start; // start of the drive in real time
 
 
 // ------------------- ZONE RELATED GLOBAL VARIABLES -------------------
 int total_zones;
-zoneInfo* all_zones[10000];
+zoneInfo** all_zones; // m zones
 
 
 // ------------------- SIMULATION RELATED GLOBAL VARIABLES -------------------
-int done = 0;
+atomic_int done = 0; // read under batch_mutex by companies and zones and under slot_mutex by zones
+int virtual_time = 0; // --virtual-time
+long sim_time = 0; // virtual clock (seconds)
+int running_threads = 1; // threads not blocked in virtual time, the main thread included
+lockWaiter* lock_waiters[LOCK_BUCKETS]; // threads waiting for a mutex in virtual time, oldest first
+simEvent** events = NULL; // min-heap of sleeping threads and arriving students ordered by time
+int num_events = 0;
+int max_events = 0;
+long event_seq = 0;
+
+
+// ------------------- VIRTUAL TIME -------------------
+// with --virtual-time, delays advance a shared virtual clock instead of the wall clock. Every thread is either running
+// or blocked (sleeping, waiting on a simCond or waiting for a mutex). Once no thread is running, the clock jumps to the
+// earliest wake up time in the event queue and the threads sleeping until then are woken up. The threads that wake
+// up a blocked thread count it as running on its behalf, so the clock never moves while a woken thread is on its way
+// back. All of the bookkeeping is protected by clock_mutex
+int eventBefore(const simEvent* a, const simEvent* b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+void pushEvent(simEvent* e)
+{
+    if(num_events == max_events)
+    {
+        max_events = (max_events > 0) ? 2 * max_events : 64;
+        events = realloc(events, sizeof(simEvent*) * max_events);
+    }
+    int i = num_events++;
+    while(i > 0 && eventBefore(e, events[(i-1)/2]))
+    {
+        events[i] = events[(i-1)/2];
+        i = (i-1)/2;
+    }
+    events[i] = e;
+}
+
+simEvent* popEvent()
+{
+    simEvent* first = events[0];
+    simEvent* last = events[--num_events];
+    int i = 0;
+    while(2*i+1 < num_events)
+    {
+        int child = 2*i+1;
+        if(child+1 < num_events && eventBefore(events[child+1], events[child]))
+            child++;
+        if(!eventBefore(events[child], last))
+            break;
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return first;
+}
+
+void readyStudent(studentInfo* si);
+
+void blockThread()
+{
+    // the calling thread stops running, if it was the last one the clock advances to the next event time
+    // (and further, if the events only queued students while every worker of the student pool is blocked)
+    running_threads--;
+    while(running_threads == 0 && num_events > 0)
+    {
+        sim_time = (long)events[0]->time;
+        while(num_events > 0 && events[0]->time == sim_time)
+        {
+            simEvent* e = popEvent();
+            if(e->student != NULL)
+                readyStudent(e->student);
+            else
+            {
+                e->woken = 1;
+                running_threads++;
+                pthread_cond_signal(&e->wake); // signal that the sleeping thread's wake up time has been reached
+            }
+        }
+    }
+}
+
+lockWaiter** lockBucket(pthread_mutex_t* mutex)
+{
+    return &lock_waiters[((uintptr_t)mutex / sizeof(pthread_mutex_t)) % LOCK_BUCKETS];
+}
+
+void releaseMutex(pthread_mutex_t* mutex)
+{
+    // wake up the thread that has waited the longest for the unlocked mutex to retry locking it
+    // (one thread per unlock: a thread that fails again waits for the next unlock of the new holder)
+    for(lockWaiter** w = lockBucket(mutex); *w != NULL; w = &(*w)->next)
+    {
+        if((*w)->mutex == mutex)
+        {
+            lockWaiter* first = *w;
+            *w = first->next;
+            first->woken = 1;
+            running_threads++;
+            pthread_cond_signal(&first->wake); // signal that the mutex has been unlocked
+            return;
+        }
+    }
+}
+
+void simSleep(int seconds)
+{
+    if(virtual_time == 0)
+    {
+        sleep(seconds);
+        return;
+    }
+    simEvent e;
+    pthread_mutex_lock(&clock_mutex);
+    e.time = sim_time + seconds;
+    e.seq = event_seq++;
+    e.woken = 0;
+    e.student = NULL;
+    pthread_cond_init(&e.wake, NULL);
+    pushEvent(&e);
+    blockThread();
+    while(e.woken == 0)
+        pthread_cond_wait(&e.wake, &clock_mutex); // wait for the clock to reach the wake up time
+    pthread_mutex_unlock(&clock_mutex);
+    pthread_cond_destroy(&e.wake);
+}
+
+void* startThread(void* input)
+{
+    // the new thread was counted as running by its creator, it stops running once its handler returns
+    threadStart ts = *(threadStart*)input;
+    free(input);
+    void* ret = ts.function(ts.arg);
+    pthread_mutex_lock(&clock_mutex);
+    blockThread();
+    pthread_mutex_unlock(&clock_mutex);
+    return ret;
+}
+
+
+// ------------------- STUDENT POOL -------------------
+// with --student-pool, students are state machines instead of threads. A small pool of worker threads runs the next
+// step of every student that can make progress: when it is created, when it arrives at the gate and when its
+// vaccination round is over. Arrivals are events at a time in the future, handled by the virtual clock with
+// --virtual-time and by a timer thread otherwise. Memory and context switches scale with the number of workers
+// instead of the number of students
+double driveTime()
+{
+    if(virtual_time)
+        return sim_time;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - drive_start.tv_sec) + (ts.tv_nsec - drive_start.tv_nsec) / 1e9;
+}
+
+void readyStudent(studentInfo* si)
+{
+    // queue the next step of student si and wake up an idle worker, called with clock_mutex held
+    si->next = NULL;
+    if(ready_tail != NULL)
+        ready_tail->next = si;
+    else
+        ready_head = si;
+    ready_tail = si;
+    if(idle_workers > 0)
+    {
+        idle_workers--;
+        worker_wakeups++;
+        running_threads++;
+        pthread_cond_signal(&work_available); // signal that a student is ready
+    }
+}
+
+void wakeStudent(studentInfo* si)
+{
+    pthread_mutex_lock(&clock_mutex);
+    readyStudent(si);
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+void scheduleStudent(studentInfo* si, int seconds)
+{
+    // the next step of student si runs after the given delay
+    pthread_mutex_lock(&clock_mutex);
+    si->arrival.time = driveTime() + seconds;
+    si->arrival.seq = event_seq++;
+    si->arrival.student = si;
+    pushEvent(&si->arrival);
+    pthread_cond_signal(&timer_changed);
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+void finishStudent()
+{
+    pthread_mutex_lock(&clock_mutex);
+    if(++finished_students == total_students && main_waiting)
+    {
+        main_waiting = 0;
+        running_threads++;
+        pthread_cond_signal(&students_finished); // signal that every student is done
+    }
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+void* timerHandler(void* input)
+{
+    // real time only: queue every student whose arrival time has come
+    (void)input;
+    pthread_mutex_lock(&clock_mutex);
+    while(pool_shutdown == 0)
+    {
+        if(num_events == 0)
+            pthread_cond_wait(&timer_changed, &clock_mutex); // wait for an arrival to be scheduled
+        else if(events[0]->time > driveTime())
+        {
+            double t = events[0]->time;
+            struct timespec deadline = {drive_start.tv_sec + (time_t)t, drive_start.tv_nsec + (long)((t - (long)t) * 1e9)};
+            if(deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&timer_changed, &clock_mutex, &deadline); // wait for the earliest arrival
+        }
+        else
+            readyStudent(popEvent()->student);
+    }
+    pthread_mutex_unlock(&clock_mutex);
+    return NULL;
+}
+
+void* studentWorker(void* input);
 
 
 // ------------------- ERROR HANDLING WRAPPER FUNCTIONS -------------------
 void pthreadCreate(pthread_t *tid, const pthread_attr_t *attr, void *function_ptr, void *arg)
 {
-    if(pthread_create(tid, attr, function_ptr, arg) != 0)
+    if(virtual_time == 0)
+    {
+        if(pthread_create(tid, attr, function_ptr, arg) != 0)
+            perror("ERROR");
+        return;
+    }
+    threadStart* ts = malloc(sizeof(threadStart));
+    ts->function = function_ptr;
+    ts->arg = arg;
+    pthread_mutex_lock(&clock_mutex);
+    running_threads++;
+    pthread_mutex_unlock(&clock_mutex);
+    if(pthread_create(tid, attr, startThread, ts) != 0)
+    {
         perror("ERROR");
+        free(ts);
+        pthread_mutex_lock(&clock_mutex);
+        blockThread();
+        pthread_mutex_unlock(&clock_mutex);
+    }
 }
 
 void pthreadJoin(pthread_t tid, void **retval)
 {
+    if(virtual_time)
+    {
+        pthread_mutex_lock(&clock_mutex);
+        blockThread();
+        pthread_mutex_unlock(&clock_mutex);
+    }
     if(pthread_join(tid, retval) != 0)
         perror("ERROR");
+    if(virtual_time)
+    {
+        pthread_mutex_lock(&clock_mutex);
+        running_threads++;
+        pthread_mutex_unlock(&clock_mutex);
+    }
 }
 
 void pthreadMutexLock(pthread_mutex_t *mutex)
 {
-    if(pthread_mutex_lock(mutex) != 0)
-        perror("ERROR");
+    if(virtual_time == 0)
+    {
+        if(pthread_mutex_lock(mutex) != 0)
+            perror("ERROR");
+        return;
+    }
+    // a thread waiting for a mutex is blocked, its holder may be sleeping in virtual time
+    pthread_mutex_lock(&clock_mutex);
+    while(pthread_mutex_trylock(mutex) != 0)
+    {
+        lockWaiter w = {mutex, 0, PTHREAD_COND_INITIALIZER, NULL};
+        lockWaiter** tail;
+        for(tail = lockBucket(mutex); *tail != NULL; tail = &(*tail)->next);
+        *tail = &w;
+        blockThread();
+        while(w.woken == 0)
+            pthread_cond_wait(&w.wake, &clock_mutex); // wait for the mutex to be unlocked
+        pthread_cond_destroy(&w.wake);
+    }
+    pthread_mutex_unlock(&clock_mutex);
 }
 
 void pthreadMutexUnlock(pthread_mutex_t *mutex)
 {
     if(pthread_mutex_unlock(mutex) != 0)
         perror("ERROR");
+    if(virtual_time)
+    {
+        pthread_mutex_lock(&clock_mutex);
+        releaseMutex(mutex);
+        pthread_mutex_unlock(&clock_mutex);
+    }
 }
 
-void pthreadCondWait(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex)
+void pthreadCondWait(simCond *restrict cond, pthread_mutex_t *restrict mutex)
 {
-    if(pthread_cond_wait(cond, mutex) != 0)
+    if(virtual_time == 0)
+    {
+        if(pthread_cond_wait(&cond->cond, mutex) != 0)
+            perror("ERROR");
+        return;
+    }
+    // registering as a waiter and unlocking the mutex are atomic with respect to the signalling threads
+    pthread_mutex_lock(&clock_mutex);
+    cond->waiters++;
+    if(pthread_mutex_unlock(mutex) != 0)
         perror("ERROR");
+    releaseMutex(mutex);
+    blockThread();
+    while(cond->wakeups == 0)
+        pthread_cond_wait(&cond->cond, &clock_mutex);
+    cond->wakeups--;
+    pthread_mutex_unlock(&clock_mutex);
+    pthreadMutexLock(mutex);
 }
 
-void pthreadCondSignal(pthread_cond_t *cond)
+void pthreadCondSignal(simCond *cond)
 {
-    if(pthread_cond_signal(cond) != 0)
-        perror("ERROR");
+    if(virtual_time == 0)
+    {
+        if(pthread_cond_signal(&cond->cond) != 0)
+            perror("ERROR");
+        return;
+    }
+    pthread_mutex_lock(&clock_mutex);
+    if(cond->waiters > 0)
+    {
+        cond->waiters--;
+        cond->wakeups++;
+        running_threads++;
+        pthread_cond_signal(&cond->cond);
+    }
+    pthread_mutex_unlock(&clock_mutex);
 }
 
-void pthreadCondBroadcast(pthread_cond_t *cond)
+void pthreadCondBroadcast(simCond *cond)
 {
-    if(pthread_cond_broadcast(cond) != 0)
-        perror("ERROR");
+    if(virtual_time == 0)
+    {
+        if(pthread_cond_broadcast(&cond->cond) != 0)
+            perror("ERROR");
+        return;
+    }
+    pthread_mutex_lock(&clock_mutex);
+    if(cond->waiters > 0)
+    {
+        cond->wakeups += cond->waiters;
+        running_threads += cond->waiters;
+        cond->waiters = 0;
+        pthread_cond_broadcast(&cond->cond);
+    }
+    pthread_mutex_unlock(&clock_mutex);
 }
 
 
@@ -122,30 +515,108 @@ void initializeZoneData(zoneInfo **z, int zone_num, int o)
     (*z)->add_ptr = 0;
     (*z)->remove_ptr = 0;
     (*z)->total_students = 0;
-    (*z)->MAX_STUDENT_NUM = o;
+    (*z)->MAX_STUDENT_NUM = (o < MIN_ZONE_QUEUE) ? o : MIN_ZONE_QUEUE;
+    (*z)->available_students = (int*)malloc(sizeof(int) * (*z)->MAX_STUDENT_NUM);
     pthread_mutex_init(&(*z)->slot_mutex, NULL);
-    pthread_cond_init(&(*z)->filled_slot, NULL);
-    pthread_cond_init(&(*z)->vaccinated, NULL);
+    (*z)->filled_slot = (simCond)SIM_COND_INITIALIZER;
+    (*z)->vaccinated = (simCond)SIM_COND_INITIALIZER;
 }
 
 
 // ------------------- FUNCTIONS UPDATING GLOBAL DATA -------------------
-batch useBatch()
+void initializeBatchQueue(batchQueue* q, int capacity)
+{
+    size_t size = 1;
+    while(size < (size_t)capacity)
+        size *= 2;
+    q->cells = (batchCell*)malloc(sizeof(batchCell) * size);
+    q->mask = size - 1;
+    for(size_t i=0; i<size; i++)
+        atomic_init(&q->cells[i].sequence, i);
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+}
+
+int enqueueBatch(batchQueue* q, batch b)
+{
+    // bounded multi-producer multi-consumer queue (Vyukov): a producer claims a position with a CAS on enqueue_pos,
+    // fills the cell and then publishes it by advancing the sequence number of the cell
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    while(1)
+    {
+        batchCell* cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->data = b;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 1;
+            }
+        }
+        else if(diff < 0)
+            return 0; // queue is full
+        else
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+}
+
+int dequeueBatch(batchQueue* q, batch* b)
+{
+    // a consumer claims a filled cell with a CAS on dequeue_pos and frees it for the producer one lap later
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    while(1)
+    {
+        batchCell* cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *b = cell->data;
+                atomic_store_explicit(&cell->sequence, pos + q->mask + 1, memory_order_release);
+                return 1;
+            }
+        }
+        else if(diff < 0)
+            return 0; // queue is empty (or the next batch is still being written)
+        else
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+}
+
+int useBatch(batch* b)
 {
-    batch b = available_batches[use_ptr];
-    (b.company)->batches_left--;
-    use_ptr = (use_ptr + 1) % MAX_BATCH_NUM;
-    total_batches--;
-    return b;
+    if(dequeueBatch(&available_batches, b) == 0)
+        return 0;
+    atomic_fetch_sub(&total_batches, 1);
+    return 1;
 }
 
 void createBatch(int capacity, companyInfo* company)
 {
     batch b = {capacity, company};
-    (b.company)->batches_left++;
-    available_batches[fill_ptr] = b;
-    fill_ptr = (fill_ptr + 1) % MAX_BATCH_NUM;
-    total_batches++;
+    atomic_fetch_add(&company->batches_left, 1);
+    // a company creates at most MAX_COMPANY_BATCHES batches and only once all of its earlier ones have been
+    // dequeued (batches_left drops after the delivery, after dequeueBatch has freed the cell), so at most
+    // MAX_BATCH_NUM cells are ever in use and the queue cannot be full
+    if(enqueueBatch(&available_batches, b) == 0)
+    {
+        fprintf(stderr, RED "Batch queue of %d batches is full\n" RESET, MAX_BATCH_NUM);
+        exit(1);
+    }
+    atomic_fetch_add(&total_batches, 1);
+
+    // a zone increments waiting_zones before it checks total_batches, so either it sees this batch or it is signalled
+    if(atomic_load(&waiting_zones) > 0)
+    {
+        pthreadMutexLock(&batch_mutex);
+        pthreadCondSignal(&created_batch); // signal that batch has been created
+        pthreadMutexUnlock(&batch_mutex);
+    }
 }
 
 int removeStudent(zoneInfo* zone)
@@ -158,6 +629,18 @@ int removeStudent(zoneInfo* zone)
 
 void addStudent(zoneInfo* zone, int student_num)
 {
+    if(zone->total_students == zone->MAX_STUDENT_NUM)
+    {
+        // double the queue, keeping the waiting students in order from the start
+        int* queue = (int*)malloc(sizeof(int) * 2 * zone->MAX_STUDENT_NUM);
+        for(int i=0; i<zone->total_students; i++)
+            queue[i] = zone->available_students[(zone->remove_ptr + i) % zone->MAX_STUDENT_NUM];
+        free(zone->available_students);
+        zone->available_students = queue;
+        zone->remove_ptr = 0;
+        zone->add_ptr = zone->total_students;
+        zone->MAX_STUDENT_NUM *= 2;
+    }
     zone->available_students[zone->add_ptr] = student_num;
     zone->add_ptr = (zone->add_ptr + 1) % zone->MAX_STUDENT_NUM;
     zone->total_students++;
@@ -174,7 +657,7 @@ void* companyHandler(void* input)
     while(1)
     {
         pthreadMutexLock(&batch_mutex);
-        while(all_companies[(ci->company_num)-1]->batches_left > 0 && done == 0)
+        while(atomic_load(&all_companies[(ci->company_num)-1]->batches_left) > 0 && done == 0)
             pthreadCondWait(&used_batch, &batch_mutex); // wait until no batches are left
         if(done == 1)
         {
@@ -185,23 +668,18 @@ void* companyHandler(void* input)
         if(count > 0)
             printf(BLUE "All the vaccines prepared by Company %d are used. Resuming production now\n" RESET, ci->company_num);
         pthreadMutexUnlock(&batch_mutex);
-        sleep(1); // time taken to resume production
+        simSleep(1); // time taken to resume production
 
         // create r batches at once
         w = rand() % 4 + 2;
-        r = rand() % 5 + 1;
+        r = rand() % MAX_COMPANY_BATCHES + 1;
         p = rand() % 11 + 10;
         printf(BLUE "Pharmaceutical Company %d is preparing %d batch(es) of vaccines with success probability %0.2lf\n" RESET, ci->company_num, r, 100 * ci->success_prob);
-        sleep(w); // time taken to create batches
+        simSleep(w); // time taken to create batches
 
-        pthreadMutexLock(&batch_mutex);
+        printf(BLUE "Pharmaceutical Company %d has prepared %d batch(es) of vaccines with success probability %0.2lf\n" RESET, ci->company_num, r, 100 * ci->success_prob);
         for(int i=0; i<r; i++)
-        {
             createBatch(p, all_companies[(ci->company_num)-1]);
-            pthreadCondSignal(&created_batch); // signal that batch has been created
-        }
-        printf(BLUE "Pharmaceutical Company %d has prepared %d batch(es) of vaccines with success probability %0.2lf\n" RESET, ci->company_num, r, 100 * ci->success_prob);
-        pthreadMutexUnlock(&batch_mutex);
         count++;
     }
     return NULL;
@@ -214,24 +692,33 @@ void* zoneHandler(void* input)
     zoneInfo* zi = (zoneInfo*)input;
     while(1)
     {
-        pthreadMutexLock(&batch_mutex);
-        while(total_batches <= 0 && done == 0)
-            pthreadCondWait(&created_batch, &batch_mutex); // wait for batch to be created
-        if(done == 1)
+        batch b;
+        int finished = 0;
+        while(finished == 0 && useBatch(&b) == 0)
         {
+            pthreadMutexLock(&batch_mutex);
+            atomic_fetch_add(&waiting_zones, 1);
+            while(atomic_load(&total_batches) <= 0 && done == 0)
+                pthreadCondWait(&created_batch, &batch_mutex); // wait for batch to be created
+            atomic_fetch_sub(&waiting_zones, 1);
+            finished = done;
             pthreadMutexUnlock(&batch_mutex);
-            break; // vaccination drive is done
         }
+        if(finished == 1)
+            break; // vaccination drive is done
 
-        batch b = useBatch();
-
+        // the delivery holds no lock, so zones receive batches in parallel
         printf(BLUE "Pharmaceutical Company %d delivering a batch (success probability %0.2lf) to Vaccination Zone %d\n" RESET, b.company->company_num, 100 * b.company->success_prob, zi->zone_num);
-        sleep(1); // time taken to deliver batch from company to vaccination zone
+        simSleep(1); // time taken to deliver batch from company to vaccination zone
         printf(BLUE "Vaccination Zone %d has received a batch from Pharmaceutical Company %d, resuming vaccinations now\n" RESET, zi->zone_num, b.company->company_num);
 
-        pthreadCondBroadcast(&used_batch); // signal to all companies that batch has been used
-        pthreadMutexUnlock(&batch_mutex);
-        sleep(1); // time taken to resume vaccination
+        if(atomic_fetch_sub(&b.company->batches_left, 1) == 1)
+        {
+            pthreadMutexLock(&batch_mutex);
+            pthreadCondBroadcast(&used_batch); // signal to all companies that the last batch of one of them has been used
+            pthreadMutexUnlock(&batch_mutex);
+        }
+        simSleep(1); // time taken to resume vaccination
 
         int vaccines_left = b.capacity;
         int zone_num = zi->zone_num;
@@ -271,7 +758,7 @@ void* zoneHandler(void* input)
             }
 
             printf(MAGENTA "Vaccination Zone %d entering vaccination phase\n" RESET, zone_num);
-            sleep(1); // time taken to enter vaccination phase
+            simSleep(1); // time taken to enter vaccination phase
 
             pthreadMutexLock(&all_zones[zone_num-1]->slot_mutex);
             pthreadMutexUnlock(&all_zones[zone_num-1]->slot_mutex);
@@ -280,11 +767,11 @@ void* zoneHandler(void* input)
             double result;
             for(int i=0; i<k; i++)
             {
-                sleep(1); // time taken to vaccinate a student
+                simSleep(1); // time taken to vaccinate a student
                 printf(RED "Student %d in Vaccination Zone %d has been vaccinated (success probability %0.2lf)\n" RESET, students[i], zi->zone_num, 100 * b.company->success_prob);
 
                 // antibody test
-                sleep(1); // time taken to perform antibody test
+                simSleep(1); // time taken to perform antibody test
                 result = rand() / (double)RAND_MAX;
                 if(result < b.company->success_prob)
                 {
@@ -302,6 +789,8 @@ void* zoneHandler(void* input)
                     pthreadCondBroadcast(&all_zones[zone_num-1]->vaccinated); // signal that student has been vaccinated
                     pthreadMutexUnlock(&all_zones[zone_num-1]->slot_mutex);
                 }
+                if(student_pool)
+                    wakeStudent(all_students[students[i]-1]); // the student's round is over
             }
             vaccines_left -= k;
         }
@@ -333,7 +822,7 @@ void* studentHandler(void* input)
 
         // randomise initial student arrival
         if(round_number == 1)
-            sleep(rand() % 20 + 1); // students become available for vaccination at different times
+            simSleep(rand() % 20 + 1); // students become available for vaccination at different times
 
         printf(GREEN "Student %d has arrived for vaccination (round %d)\n" RESET, si->student_num, round_number);
         printf(GREEN "Student %d waiting to be allocated a slot in a Vaccination Zone\n" RESET, si->student_num);
@@ -354,42 +843,146 @@ void* studentHandler(void* input)
 }
 
 
+// ------------------- STUDENT STATE MACHINE -------------------
+void studentStep(studentInfo* si)
+{
+    // the body of the loop of studentHandler, up to the point where the student thread would block
+    if(si->result == 1)
+    {
+        printf(CYAN "Student %d has been successfully vaccinated, can now attend college!\n" RESET, si->student_num);
+        finishStudent();
+        return;
+    }
+    if(si->vaccination_round > 3)
+    {
+        printf(CYAN "Student %d could not be vaccinated, cannot attend college\n" RESET, si->student_num);
+        finishStudent();
+        return;
+    }
+
+    // randomise initial student arrival
+    if(si->state == STUDENT_NEW)
+    {
+        si->state = STUDENT_ARRIVING;
+        scheduleStudent(si, rand() % 20 + 1); // students become available for vaccination at different times
+        return;
+    }
+
+    printf(GREEN "Student %d has arrived for vaccination (round %d)\n" RESET, si->student_num, si->vaccination_round);
+    printf(GREEN "Student %d waiting to be allocated a slot in a Vaccination Zone\n" RESET, si->student_num);
+
+    // the zone queues the next step once the student has completed the current round of vaccination
+    si->state = STUDENT_WAITING;
+    int zone_num = rand() % total_zones + 1;
+    pthreadMutexLock(&all_zones[zone_num-1]->slot_mutex);
+    addStudent(all_zones[zone_num-1], si->student_num);
+    pthreadCondSignal(&all_zones[zone_num-1]->filled_slot); // signal that student is ready for vaccination
+    pthreadMutexUnlock(&all_zones[zone_num-1]->slot_mutex);
+}
+
+void* studentWorker(void* input)
+{
+    (void)input;
+    pthread_mutex_lock(&clock_mutex);
+    while(1)
+    {
+        if(ready_head != NULL)
+        {
+            studentInfo* si = ready_head;
+            ready_head = si->next;
+            if(ready_head == NULL)
+                ready_tail = NULL;
+            pthread_mutex_unlock(&clock_mutex);
+            studentStep(si);
+            pthread_mutex_lock(&clock_mutex);
+            continue;
+        }
+        if(pool_shutdown == 1)
+            break;
+
+        idle_workers++;
+        if(virtual_time)
+            blockThread();
+        while(worker_wakeups == 0)
+            pthread_cond_wait(&work_available, &clock_mutex); // wait for a student to be ready
+        worker_wakeups--;
+    }
+    pthread_mutex_unlock(&clock_mutex);
+    return NULL;
+}
+
+
 // ------------------- MAIN (THREAD) -------------------
-int main()
+int main(int argc, char* argv[])
 {
+    static struct option long_options[] = {
+        {"virtual-time", no_argument, NULL, 'v'},
+        {"student-pool", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "vs", long_options, NULL)) != -1)
+    {
+        if(opt == 'v')
+            virtual_time = 1;
+        else if(opt == 's')
+            student_pool = 1;
+        else
+        {
+            fprintf(stderr, "Usage: %s [--virtual-time] [--student-pool]\n", argv[0]);
+            return 1;
+        }
+    }
+
     srand(time(0));
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &drive_start);
+    pthread_condattr_t timer_attr;
+    pthread_condattr_init(&timer_attr);
+    pthread_condattr_setclock(&timer_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_changed, &timer_attr);
     int n, m, o;
     printf("Enter the number of companies, vaccination zones and students: ");
     scanf("%d %d %d", &n, &m, &o);
-    MAX_BATCH_NUM = n * 20;
 
     // handle the case when n, m, o = 0
-    if(n == 0 || m == 0 || o == 0)
+    if(n <= 0 || m <= 0 || o <= 0)
     {
-        if(n == 0)
+        if(n <= 0)
             printf(CYAN "No Pharmaceutical Companies are available to prepare vaccines\n" RESET);
-        if(m == 0)
+        if(m <= 0)
             printf(CYAN "No Vaccination Zones available for vaccination\n" RESET);
-        if(o == 0)
+        if(o <= 0)
             printf(CYAN "No students available for vaccination\n" RESET);
         printf(CYAN "Vaccination drive unsuccessful\n" RESET);
         return 0;
     }
 
+    // every array is sized from the input
+    MAX_BATCH_NUM = n * MAX_COMPANY_BATCHES;
+    initializeBatchQueue(&available_batches, MAX_BATCH_NUM);
+    all_companies = (companyInfo**)malloc(sizeof(companyInfo*) * n);
+    all_zones = (zoneInfo**)malloc(sizeof(zoneInfo*) * m);
+    all_students = (studentInfo**)malloc(sizeof(studentInfo*) * o);
+
     total_zones = m;
+    total_students = o;
     for(int i=0; i<m; i++)
         initializeZoneData(&all_zones[i], i+1, o); // initialize zone data
 
-    pthread_t companies[n], zones[m], students[o];
+    long num_workers = student_pool ? sysconf(_SC_NPROCESSORS_ONLN) : 0;
+    num_workers = (student_pool && num_workers < 1) ? 1 : num_workers;
+    pthread_t *companies = malloc(sizeof(pthread_t) * n), *zones = malloc(sizeof(pthread_t) * m), timer;
+    pthread_t *students = malloc(sizeof(pthread_t) * (student_pool ? 1 : o)), *workers = malloc(sizeof(pthread_t) * (num_workers + 1));
     printf("Enter the success probabilities of each company (between 0 and 1): ");
     for(int i=0; i<n; i++)
     {
         all_companies[i] = (companyInfo*)malloc(sizeof(companyInfo));
         all_companies[i]->company_num = i+1;
-        all_companies[i]->batches_left = 0;
+        atomic_init(&all_companies[i]->batches_left, 0);
         scanf("%lf", &all_companies[i]->success_prob);
         pthreadCreate(&companies[i], NULL, companyHandler, (void*)all_companies[i]);
-        sleep(1);
+        simSleep(1);
     }
 
     for(int i=0; i<o; i++)
@@ -398,25 +991,67 @@ int main()
         all_students[i]->student_num = i+1;
         all_students[i]->vaccination_round = 1;
         all_students[i]->result = 0;
-        pthreadCreate(&students[i], NULL, studentHandler, (void*)all_students[i]);
+        all_students[i]->state = STUDENT_NEW;
+        if(student_pool)
+            wakeStudent(all_students[i]);
+        else
+            pthreadCreate(&students[i], NULL, studentHandler, (void*)all_students[i]);
     }
+    for(int i=0; i<num_workers; i++)
+        pthreadCreate(&workers[i], NULL, studentWorker, NULL);
+    if(student_pool && virtual_time == 0)
+        pthreadCreate(&timer, NULL, timerHandler, NULL);
 
     for(int i=0; i<m; i++)
     {
         pthreadCreate(&zones[i], NULL, zoneHandler, (void*)all_zones[i]);
-        sleep(1);
+        simSleep(1);
     }
 
     // join threads
-    for(int i=0; i<o; i++)
-        pthreadJoin(students[i], NULL);
+    if(student_pool)
+    {
+        pthread_mutex_lock(&clock_mutex);
+        while(finished_students < total_students)
+        {
+            if(main_waiting == 0)
+            {
+                main_waiting = 1;
+                if(virtual_time)
+                    blockThread();
+            }
+            pthread_cond_wait(&students_finished, &clock_mutex); // wait for every student to be done
+        }
+        pool_shutdown = 1;
+        running_threads += idle_workers;
+        worker_wakeups += idle_workers;
+        idle_workers = 0;
+        pthread_cond_broadcast(&work_available);
+        pthread_cond_signal(&timer_changed);
+        pthread_mutex_unlock(&clock_mutex);
+        for(int i=0; i<num_workers; i++)
+            pthreadJoin(workers[i], NULL);
+        if(virtual_time == 0)
+            pthreadJoin(timer, NULL);
+    }
+    else
+        for(int i=0; i<o; i++)
+            pthreadJoin(students[i], NULL);
 
     // signal all waiting companies and zones that simulation is done
+    // (done is atomic because zones also read it under slot_mutex; it is set under batch_mutex before each slot_mutex
+    // is taken to signal, so a waiter that saw done == 0 under either mutex is already waiting when the signal comes)
+    pthreadMutexLock(&batch_mutex);
     done = 1;
-    for(int i=0; i<m; i++)
-        pthreadCondSignal(&all_zones[i]->filled_slot);
     pthreadCondBroadcast(&created_batch);
     pthreadCondBroadcast(&used_batch);
+    pthreadMutexUnlock(&batch_mutex);
+    for(int i=0; i<m; i++)
+    {
+        pthreadMutexLock(&all_zones[i]->slot_mutex);
+        pthreadCondSignal(&all_zones[i]->filled_slot);
+        pthreadMutexUnlock(&all_zones[i]->slot_mutex);
+    }
 
     for(int i=0; i<n; i++)
         pthreadJoin(companies[i], NULL);
@@ -427,11 +1062,27 @@ int main()
     for(int i=0; i<n; i++)
         free(all_companies[i]);
     for(int i=0; i<m; i++)
+    {
+        free(all_zones[i]->available_students);
         free(all_zones[i]);
+    }
     for(int i=0; i<o; i++)
         free(all_students[i]);
+    free(all_companies);
+    free(all_zones);
+    free(all_students);
+    free(available_batches.cells);
+    free(companies);
+    free(zones);
+    free(students);
+    free(workers);
 
     printf(CYAN "All students are done with vaccination\n" RESET);
     printf(CYAN "Vaccination drive completed!\n" RESET);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(virtual_time)
+        printf(CYAN "Simulated %ld second(s) in %.3lf second(s)\n" RESET, sim_time,
+               (end.tv_sec - drive_start.tv_sec) + (end.tv_nsec - drive_start.tv_nsec) / 1e9);
+    free(events);
     return 0;
 }